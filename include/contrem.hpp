@@ -97,6 +97,9 @@ public:
 	bool onlySamples;						///<! If checked, only sample points will be processed, not the entire grid.
 	NormMethod normMethod;					///<! The normalization method.
 	int threads;							///<! The number of threads to use.
+	bool remapCache;						///<! If true, the remapped raster is cached on disk and reused by later runs.
+	std::string remapCacheDir;				///<! The remap cache directory. If empty, the cache is stored next to the input.
+	bool remapCompress;						///<! If true, the remapped raster is stored in compressed tiles rather than raw.
 	bool running;							///<! True if the process is running. Setting this to false causes shutdown.
 
 	GDALReader* grdr;						///<! A pointer to the reader if it was a raster reader;
@@ -11,6 +11,10 @@
 #include <string>
 #include <fstream>
 #include <memory>
+#include <atomic>
+#include <mutex>
+#include <list>
+#include <future>
 
 #include "util.hpp"
 #include "reader.hpp"
@@ -23,75 +27,6 @@ using namespace hlrg::writer;
 namespace hlrg {
 namespace convolve {
 
-/**
- * The kernel class holds the step values, plus the min
- * and max wavelengths for the range.
- */
-class Kernel {
-private:
-	double m_wl;
-	double m_fwhm;
-	int m_window;
-	int m_index;		///<! Index into the array of source wavelengths.
-	std::vector<double> m_kernel;
-
-public:
-
-	/**
-	 * Create a kernel around the given wavelength with the given
-	 * full width at half maximum. The threshold gives the value
-	 * of the Gaussian beyond which the kernel is not applied.
-	 *
-	 * \param size The number of kernel elements.
-	 * \param bandDist The distance between the input bands.
-	 * \param wl The centre wavelength.
-	 * \param fwhm The full width at half maximum.
-	 * \param window The size of the window; an odd integer.
-	 */
-	Kernel(double wl, double fwhm, int window, int index);
-
-	int index() const;
-
-	/**
-	 * Set the wavelength.
-	 *
-	 * \param wl The wavelength.
-	 */
-	void setWavelength(double wl);
-
-	/**
-	 * Get the wavelength.
-	 *
-	 * \return The wavelength.
-	 */
-	double wl() const;
-
-	/**
-	 * Set the full width at half maximum.
-	 *
-	 * \param fwhm The full width at half maximum.
-	 */
-	void setFWHM(double fwhm);
-
-	/**
-	 * Get the full width at half maximum.
-	 *
-	 * \return The full width at half maximum.
-	 */
-	double fwhm() const;
-
-	void setWindow(int window);
-
-	int window() const;
-
-	double apply(const std::vector<double>& intensities, const std::vector<double>& wavelengths, int idx) const;
-
-	bool operator<(const Kernel& other) const;
-
-	~Kernel();
-};
-
-
 /**
  * Contains the information about each band that will be used to build
  * the convolution kernel.
@@ -221,10 +156,15 @@ private:
 	int m_timeCol;									///<! The timestamp column (or -1 if not used.)
 
 	std::unique_ptr<GDALReader> m_raster;
+	std::unique_ptr<FlameReader> m_log;				///<! The reader for a binary spectral log input.
+	FlameRow m_logRow;								///<! The current spectral log row.
 	int m_col;
 	int m_row;
 	size_t m_rasterIdx;
 
+	SpectralBlock m_block;							///<! The current block of raster spectra.
+	size_t m_blockIdx;								///<! The index of the next spectrum in the block.
+
 	std::string m_projection;
 	double m_trans[6];
 
@@ -232,6 +172,8 @@ private:
 
 	bool loadRaster(const std::string& filename, size_t memLimit);
 
+	bool loadLog(const std::string& filename);
+
 public:
 	std::vector<Band> bands;						///<! A list of the bands. This changes as the file is read through.
 	std::vector<double> wavelengths;
@@ -239,6 +181,7 @@ public:
 	std::map<std::string, std::string> properties;	///<! Properties read from the header block.
 	std::string date;								///<! The date of the current row.
 	long time;										///<! The timestamp of the current row.
+	long dateTime;									///<! The date of the current row in milliseconds, if known; otherwise zero.
 
 	Spectrum();
 
@@ -257,6 +200,8 @@ public:
 	 * \param delimiter The column delimiter.
 	 * \param firstRow The zero-based index of the first row of data.
 	 * \param firstcol  The zero-based index of the first column of data.
+	 * \param memLimit For rasters, the memory available to read-ahead buffers. Rasters are read
+	 *                 a row at a time, directly from the source, so this only controls how far ahead.
 	 * \return True if the file is loaded and has information in it.
 	 */
 	bool load(const std::string& filename, const std::string& delimiter, size_t memLimit);
@@ -305,6 +250,14 @@ public:
 	 */
 	void shift(double shift);
 
+	/**
+	 * Keep only the given bands. For a raster, only those bands are read from the source
+	 * from then on. Other inputs are unchanged, since their records are read whole anyway.
+	 *
+	 * \param idx The indices of the bands to keep, in ascending order.
+	 */
+	void selectBands(const std::vector<int>& idx);
+
 	/**
 	 * Set the values of all bands to zero.
 	 */
@@ -334,12 +287,30 @@ public:
 
 	void write(GDALWriter* wtr, double minWl, double maxWl, int col, int row);
 
+	/**
+	 * Write the bands of an output spectrum, between the given
+	 * wavelengths, to a binary spectral log.
+	 *
+	 * \param wtr A SpectralLogWriter.
+	 * \param minWl The minimum wavelength to write.
+	 * \param maxWl The maximum wavelength to write.
+	 */
+	void write(SpectralLogWriter* wtr, double minWl, double maxWl);
+
 	int col() const;
 
 	int row() const;
 
 	std::unique_ptr<GDALReader>& raster();
 
+	/**
+	 * Return the wavelength units of a spectral log input, or an empty string if the
+	 * input isn't a log or the units aren't known.
+	 *
+	 * \return The wavelength units.
+	 */
+	std::string units() const;
+
 };
 
 
@@ -383,6 +354,67 @@ public:
 
 
 
+/**
+ * Holds the Gaussian kernels for every output band, built against the actual
+ * input wavelengths. Each output band's support is derived from its FWHM and
+ * the tolerance, and taps outside of it are pruned. The remaining taps cover a
+ * contiguous run of input bands, and the weights for all output bands are packed
+ * into a single array so the inner loop is a straight multiply-accumulate.
+ */
+class KernelSet {
+private:
+	std::vector<double> m_inputWl;		///<! The input wavelengths (shifted) the set was built for.
+	std::vector<double> m_inputScale;	///<! The input scales the set was built for.
+	std::vector<size_t> m_offset;		///<! For each output band, the offset of its first weight.
+	std::vector<int> m_first;			///<! For each output band, the index of the first input band.
+	std::vector<int> m_count;			///<! For each output band, the number of taps.
+	std::vector<double> m_weights;		///<! The weights for all output bands, contiguous.
+
+public:
+
+	/**
+	 * Build the kernels.
+	 *
+	 * \param props The output band definitions.
+	 * \param inputs The input bands. The shift and scale of each are folded into the weights.
+	 * \param tolerance Taps where the Gaussian falls below this value (relative to the peak) are pruned.
+	 */
+	void build(const std::map<int, BandProp>& props, const std::vector<Band>& inputs, double tolerance);
+
+	/**
+	 * Return true if the set was built for input bands with the same
+	 * wavelengths and scales as the given ones, and can be reused.
+	 *
+	 * \param inputs The input bands.
+	 * \return True if the set can be reused.
+	 */
+	bool matches(const std::vector<Band>& inputs) const;
+
+	/**
+	 * Convolve the input intensities into the output.
+	 *
+	 * \param input The input intensities, one per input band.
+	 * \param output The output intensities, one per output band.
+	 */
+	void apply(const double* input, double* output) const;
+
+	/**
+	 * Return the indices of the input bands that have a non-zero weight in any kernel,
+	 * in ascending order. The others don't affect the output and needn't be read.
+	 *
+	 * \return The indices of the used input bands.
+	 */
+	std::vector<int> inputs() const;
+
+	/**
+	 * Return the total number of taps over all output bands.
+	 *
+	 * \return The number of taps.
+	 */
+	size_t taps() const;
+
+};
+
 /**
  * Forward declaration.
  */
@@ -433,10 +465,37 @@ public:
  */
 class Convolve {
 private:
-	double m_progress;	///<! The current progress, between 0 and 1.
+	ConvolveListener* m_listener;		///<! The listener receiving progress updates.
+	std::atomic<size_t> m_count;		///<! The number of records to process.
+	std::atomic<size_t> m_current;		///<! The number of records processed.
+	std::atomic<long> m_lastUpdate;		///<! The time (ms) of the last progress notification.
+	std::mutex m_updateMtx;				///<! Serializes calls to the listener.
+
+	/**
+	 * Process files from the queue until it is empty or running becomes false.
+	 * Run by each worker thread.
+	 */
+	void doRun(std::list<std::string>* queue, std::mutex* mtx,
+			const std::string* bandDef, const std::string* bandDefDelim, const std::string* spectraDelim,
+			int spectraFirstRow, int spectraFirstCol, int spectraDateCol, int spectraTimeCol,
+			const std::string* output, const std::string* outputDelim, FileType outputType,
+			double inputScale, double tolerance, double bandShift, size_t memLimit,
+			bool* running, bool binary);
+
+	/**
+	 * Send a progress update to the listener. Updates are dropped if the previous
+	 * one was sent less than UPDATE_INTERVAL ms ago, unless force is true.
+	 *
+	 * \param force Send the update regardless of the interval.
+	 */
+	void notify(bool force);
 
 public:
 
+	static constexpr long UPDATE_INTERVAL = 100;	///<! The minimum time (ms) between progress updates.
+
+	Convolve();
+
 	/**
 	 * Run the convolve on the given files. The listener will receive callbacks.
 	 *
@@ -454,16 +513,46 @@ public:
 	 * \param inputScale Scale every input spectral value by this much.
 	 * \param tolerance A value that dictates how wide the Gaussian will be by providing a minimum threshold for the y-value.
 	 * \param bandShift If given and non-zero, will cause the input band designations to be shifted by the given amount.
-	 * \param memLimit The amount of memory that will trigger the use of file-backed storaged.
+	 * \param memLimit The amount of memory available to each thread for raster read buffers.
 	 * \param threads The number of threads -- memLimit must be multiplied by this.
 	 * \param running A reference to a boolean that is true so long as the processor should keep running.
+	 * \param binary If true, non-raster inputs are written as binary spectral logs (.slog) instead of text. Spectral log inputs are always written as logs.
 	 */
 	void run(ConvolveListener& listener,
 			const std::string& bandDef, const std::string& bandDefDelim,
 			const std::vector<std::string>& spectra, const std::string& spectraDelim,
 			int spectraFirstRow, int spectraFirstCol, int spectraDateCol, int spectraTimeCol,
 			const std::string& output, const std::string& outputDelim, FileType outputType,
-			double inputScale, double tolerance, double bandShift, size_t memLimit, int threads, bool& running);
+			double inputScale, double tolerance, double bandShift, size_t memLimit, int threads, bool& running,
+			bool binary = false);
+
+	/**
+	 * Run the convolve on a single spectral file and append the convolved records to the
+	 * given in-memory FlameReader instead of writing them to a file. The reader's wavelengths
+	 * are set to the output bands. This lets the reflectance stage consume the convolved
+	 * irradiance without a round-trip through a CSV file.
+	 *
+	 * \param listener A ConvolveListener to receive updates.
+	 * \param bandDef The band definition file.
+	 * \param bandDefDelim The delimiter for the data file.
+	 * \param spectra The spectral data file.
+	 * \param spectraDelim The delimiter for the data file.
+	 * \param spectraFirstRow The zero-based index of the first data row.
+	 * \param spectraFirstCol The zero-based index of the first data column.
+	 * \param spectraDateCol The zero-based index of a date string. -1 for none.
+	 * \param spectraTimeCol The zero-based index of a timestamp. -1 for none.
+	 * \param inputScale Scale every input spectral value by this much.
+	 * \param tolerance A value that dictates how wide the Gaussian will be by providing a minimum threshold for the y-value.
+	 * \param bandShift If given and non-zero, will cause the input band designations to be shifted by the given amount.
+	 * \param output An in-memory FlameReader to receive the convolved records.
+	 * \param running A reference to a boolean that is true so long as the processor should keep running.
+	 */
+	void run(ConvolveListener& listener,
+			const std::string& bandDef, const std::string& bandDefDelim,
+			const std::string& spectra, const std::string& spectraDelim,
+			int spectraFirstRow, int spectraFirstCol, int spectraDateCol, int spectraTimeCol,
+			double inputScale, double tolerance, double bandShift,
+			FlameReader& output, bool& running);
 
 	/**
 	 * Return a guess of the amount of memory needed to process the input file.
@@ -11,12 +11,20 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <list>
 #include <unordered_map>
 #include <fstream>
+#include <cstdint>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <exception>
+#include <algorithm>
 
 #include <gdal_priv.h>
 
-#include "bintree.hpp"
 #include "ds/kdtree.hpp"
 #include "util.hpp"
 
@@ -26,6 +34,192 @@ namespace reader {
 constexpr double MIN_VALUE = 0.000001; // Note: Can't use this; screws up hull std::numeric_limits<double>::min();
 constexpr double WL_SCALE = 100000;
 
+/**
+ * Parse a date string using the given format (see std::get_time), with optional fractional
+ * seconds, and return the UTC time in milliseconds since the epoch.
+ *
+ * \param input A date string.
+ * \param fmt The date format.
+ * \return The UTC time in milliseconds since the epoch.
+ */
+long getUTCMilSec(const std::string& input, const std::string& fmt);
+
+/**
+ * Parse a UTC date with the fields in year, month, day, hour, minute, second order, separated
+ * by any single non-digit characters, with optional fractional seconds; for example,
+ * "2018-05-09 16:42:03.125". Unlike getUTCMilSec, this doesn't use the C library's shared
+ * time state, so it's safe to call from several threads.
+ *
+ * \param input A date string.
+ * \param ms Updated with the UTC time in milliseconds since the epoch.
+ * \return True if the date was parsed.
+ */
+bool parseUTCMilSec(const std::string& input, long& ms);
+
+/**
+ * Definitions for the binary spectral log format, a compact alternative to the convolved
+ * Flame CSV. The file starts with a Header, followed by one double per band giving the
+ * wavelengths, followed by fixed-width records. Each record is the date (int64, ms since
+ * the epoch), the timestamp (int64) and one float32 value per band. Records are written
+ * in timestamp order, so readers can binary search by time. All values are host byte order.
+ */
+namespace slog {
+
+	constexpr char MAGIC[8] = {'H', 'L', 'R', 'G', 'S', 'L', 'O', 'G'};	///<! Identifies a spectral log file.
+	constexpr uint32_t VERSION = 1;											///<! The format version.
+
+	/**
+	 * The spectral log file header.
+	 */
+	struct Header {
+		char magic[8];		///<! Always MAGIC.
+		uint32_t version;	///<! The format version.
+		uint32_t bands;		///<! The number of bands (and wavelengths).
+		uint64_t records;	///<! The number of records.
+		char units[16];		///<! The wavelength units, null-terminated.
+	};
+
+	/**
+	 * Return the size in bytes of a record with the given number of bands.
+	 *
+	 * \param bands The number of bands.
+	 * \return The size of a record.
+	 */
+	inline size_t recordSize(size_t bands) {
+		return 2 * sizeof(int64_t) + bands * sizeof(float);
+	}
+
+	/**
+	 * Return the offset in bytes of the first record in a file with the given number of bands.
+	 *
+	 * \param bands The number of bands.
+	 * \return The offset of the first record.
+	 */
+	inline size_t dataOffset(size_t bands) {
+		return sizeof(Header) + bands * sizeof(double);
+	}
+
+	/**
+	 * Return true if the file at the given path is a spectral log.
+	 *
+	 * \param filename A filename.
+	 * \return True if the file is a spectral log.
+	 */
+	bool isSpectralLog(const std::string& filename);
+
+} // slog
+
+/**
+ * Support for reading ENVI header (.hdr) files directly, for raw layouts that
+ * can be used without going through GDAL.
+ */
+namespace envi {
+
+	/**
+	 * The fields of an ENVI header.
+	 */
+	class Header {
+	public:
+		int samples;								///<! The number of columns.
+		int lines;									///<! The number of rows.
+		int bands;									///<! The number of bands.
+		size_t headerOffset;						///<! The number of bytes before the data in the data file.
+		int dataType;								///<! The ENVI data type code.
+		int byteOrder;								///<! 0 for little-endian, 1 for big-endian.
+		std::string interleave;						///<! The interleave, lowercase: bsq, bil or bip.
+		std::string fileType;						///<! The file type, e.g. "ENVI Standard" or "ENVI Spectral Library".
+		std::string wavelengthUnits;				///<! The wavelength units.
+		std::vector<double> wavelengths;			///<! The band wavelengths, if given.
+		std::vector<std::string> bandNames;			///<! The band names (or spectra names for libraries), if given.
+		std::map<std::string, std::string> fields;	///<! All fields by lowercase name, with braces stripped.
+
+		Header();
+
+		/**
+		 * Return the GDAL data type corresponding to the ENVI data type, or GDT_Unknown.
+		 *
+		 * \return The GDAL data type.
+		 */
+		GDALDataType gdalType() const;
+
+		/**
+		 * Return true if the data is in the host byte order.
+		 *
+		 * \return True if the data is in the host byte order.
+		 */
+		bool hostOrder() const;
+	};
+
+	/**
+	 * Return the path of the header file for the given ENVI data file, or an empty string if there isn't one.
+	 * Both "file.hdr" and "file.ext.hdr" are checked.
+	 *
+	 * \param filename The data file.
+	 * \return The header filename.
+	 */
+	std::string headerFile(const std::string& filename);
+
+	/**
+	 * Read the header file.
+	 *
+	 * \param filename The header file.
+	 * \param hdr The header to populate.
+	 * \return True if the header was read.
+	 */
+	bool readHeader(const std::string& filename, Header& hdr);
+
+} // envi
+
+/**
+ * A contiguous run of spectra returned by Reader::nextBlock, with the coordinates
+ * (and identifiers, if the source has them) of each. The spectra are stored one after
+ * another, each bands values long. The data pointer may refer to the reader's own
+ * memory, in which case it is valid until the next call to nextBlock.
+ */
+class SpectralBlock {
+public:
+	const double* data;				///<! The spectra.
+	size_t count;					///<! The number of spectra.
+	int bands;						///<! The number of values in each spectrum.
+	std::vector<int> cols;			///<! The column of each spectrum.
+	std::vector<int> rows;			///<! The row of each spectrum.
+	std::vector<std::string> ids;	///<! The identifier of each spectrum; empty if the source has none.
+	std::vector<double> buf;		///<! Storage for the spectra, when they aren't a view of the reader's memory.
+
+	SpectralBlock() :
+		data(nullptr), count(0), bands(0) {}
+
+	/**
+	 * Size the block for the given number of spectra. Resizes the coordinate lists and,
+	 * if copy is true, the buffer, and points data at the buffer. Clears the ids.
+	 *
+	 * \param count The number of spectra.
+	 * \param bands The number of bands.
+	 * \param copy True if the spectra will be copied into the buffer.
+	 */
+	void resize(size_t count, int bands, bool copy = true) {
+		this->count = count;
+		this->bands = bands;
+		cols.resize(count);
+		rows.resize(count);
+		ids.clear();
+		if(copy) {
+			buf.resize(count * bands);
+			data = buf.data();
+		}
+	}
+
+	/**
+	 * Return a pointer to the ith spectrum.
+	 *
+	 * \param i The index of the spectrum.
+	 * \return A pointer to the first value of the spectrum.
+	 */
+	const double* spectrum(size_t i) const {
+		return data + i * bands;
+	}
+};
+
 /**
  * Abstract class for object that read spectral datasets.
  */
@@ -40,12 +234,25 @@ protected:
 	int m_row;								///<! Current row for iteration.
 	int m_bufSize;							///<! The buffer size.
 
-	std::map<int, int> m_bandMap;			///<! A index-to-band mapping.
+	std::vector<int> m_wavelengths;			///<! The scaled wavelengths, sorted ascending.
+	std::vector<int> m_wlBands;				///<! The band number of each entry in m_wavelengths.
+	std::vector<int> m_bandWl;				///<! The scaled wavelength of each band, indexed by band number; zero if none.
 	std::vector<std::string> m_bandNames;	///<! A list of band names; possibly for storing a representation of the band wavelength, etc.
 	int m_minWl; 							///<! Minimum wavelength; these are scaled to avoid representation issues.
 	int m_maxWl;							///<! Maximum wavelength.
 	int m_minIdx;							///<! Minimum band index.
 	int m_maxIdx;							///<! Maximum band index.
+	std::vector<int> m_bandList;			///<! The selected bands, ascending, if they aren't a contiguous range; otherwise empty.
+
+	/**
+	 * Return the bands whose wavelengths are in any of the given ranges, in wavelength order.
+	 */
+	std::vector<int> bandsInWindows(const std::vector<std::pair<double, double>>& windows) const;
+
+	/**
+	 * Return true if the reader can read a selection of bands that isn't a contiguous run.
+	 */
+	virtual bool supportsBandList() const;
 
 public:
 
@@ -75,27 +282,64 @@ public:
 	 */
 	virtual bool next(std::string& id, std::vector<double>& buf, int& cols, int& col, int& row) = 0;
 
+	/**
+	 * Read the next run of spectra into the block, in the band range set on the reader.
+	 * This is an alternative to next that avoids per-spectrum copies and calls; the two
+	 * share a position, so they shouldn't be mixed.
+	 *
+	 * \param block The block to fill.
+	 * \param maxCount The maximum number of spectra to return; zero to let the reader decide.
+	 *                 Rasters read without remapping always return whole rows.
+	 * \return True if any spectra were read; false at the end of the data.
+	 */
+	virtual bool nextBlock(SpectralBlock& block, size_t maxCount = 0) = 0;
+
 	/**
 	 * Set the size of the buffer for reading.
 	 *
 	 * \param bufSize The size of the buffer.
 	 */
-	void setBufSize(int bufSize);
+	virtual void setBufSize(int bufSize);
 
 	/**
 	 * Set the band map; a mapping of band index to band number.
 	 *
 	 * \param map A map containing the mapping from band index to band number.
 	 */
-	void setBandMap(const std::map<int, int>& map);
+	virtual void setBandMap(const std::map<int, int>& map);
 
 	/**
-	 * Sets the range of wavelengths.
+	 * Select the bands whose wavelengths are in the given range. If there are none,
+	 * the band nearest the middle of the range is selected.
 	 *
 	 * \param min The minimum wavelength.
 	 * \param max The maximum wavelength.
 	 */
-	void setBandRange(double min, double max);
+	virtual void setBandRange(double min, double max);
+
+	/**
+	 * Select the given bands. Only those are read by next and nextBlock, and
+	 * reported by bands, getWavelengths and getBandNames. Readers that can't read
+	 * any subset of bands only accept a contiguous run.
+	 *
+	 * \param bands The band numbers. Sorted, and duplicates removed.
+	 */
+	virtual void setBands(const std::vector<int>& bands);
+
+	/**
+	 * Select the bands whose wavelengths are in any of the given ranges; for example,
+	 * several absorption features. If there are none, nothing is changed.
+	 *
+	 * \param windows A list of (minimum, maximum) wavelength pairs.
+	 */
+	void setBandWindows(const std::vector<std::pair<double, double>>& windows);
+
+	/**
+	 * Return the selected band numbers in ascending order.
+	 *
+	 * \return The selected bands.
+	 */
+	std::vector<int> selectedBands() const;
 
 	/**
 	 * Return a vector containing the wavelengths.
@@ -133,6 +377,22 @@ public:
 	 */
 	std::map<int, int> getBandMap();
 
+	/**
+	 * Return the band whose wavelength is nearest to the given one.
+	 *
+	 * \param wl A wavelength.
+	 * \return The band number, or zero if there are no wavelengths.
+	 */
+	int nearestBand(double wl) const;
+
+	/**
+	 * Return the wavelength of the given band.
+	 *
+	 * \param band The band number.
+	 * \return The wavelength, or zero if the band has none.
+	 */
+	double bandWavelength(int band) const;
+
 	/**
 	 * Returns the number of bands.
 	 *
@@ -215,6 +475,254 @@ public:
 	const std::map<int, int>& bandMap() const;
 };
 
+/**
+ * A small least-recently-used cache of raster blocks, keyed by band and block
+ * position. Blocks are stored as floats, row by row, at the full block width,
+ * even at the raster's right and bottom edges. Not thread-safe.
+ */
+class BlockCache {
+private:
+	std::list<std::pair<uint64_t, std::vector<float>>> m_entries;	///<! The cached blocks, most recently used first.
+	std::unordered_map<uint64_t, decltype(m_entries)::iterator> m_index;	///<! The cached blocks, by key.
+	size_t m_capacity;	///<! The maximum number of cached blocks.
+
+public:
+
+	/**
+	 * Construct a cache holding up to the given number of blocks.
+	 *
+	 * \param capacity The maximum number of cached blocks.
+	 */
+	BlockCache(size_t capacity = 64);
+
+	/**
+	 * Set the maximum number of cached blocks, evicting as needed.
+	 *
+	 * \param capacity The maximum number of cached blocks.
+	 */
+	void setCapacity(size_t capacity);
+
+	/**
+	 * Return the values of the given block, reading it from the dataset if it
+	 * isn't cached.
+	 *
+	 * \param ds The dataset.
+	 * \param band The band (1-based).
+	 * \param bcol The block column.
+	 * \param brow The block row.
+	 * \return A pointer to the block's values, or nullptr if the read fails.
+	 */
+	const float* get(GDALDataset* ds, int band, int bcol, int brow);
+
+	/**
+	 * Remove all blocks.
+	 */
+	void clear();
+};
+
+/**
+ * A raster mask packed into a bitmap, one bit per pixel, where a pixel is set if its
+ * value is greater than zero. The bits are stored tile by tile, following the source's
+ * block grid, along with the number of set pixels in each tile, so that empty tiles
+ * can be skipped without touching their bits.
+ */
+class RasterMask {
+private:
+	int m_cols;						///<! The number of columns.
+	int m_rows;						///<! The number of rows.
+	int m_tileCols;					///<! The number of columns in a tile.
+	int m_tileRows;					///<! The number of rows in a tile.
+	int m_tilesX;					///<! The number of tiles across.
+	size_t m_tileWords;				///<! The number of words in a tile's bitmap.
+	std::vector<uint64_t> m_bits;	///<! The bitmaps of the tiles, one after another.
+	std::vector<uint32_t> m_counts;	///<! The number of set pixels in each tile.
+	size_t m_count;					///<! The number of set pixels.
+
+public:
+
+	/**
+	 * Read the mask from a raster. Tiles are read in parallel, each thread with
+	 * its own dataset handle.
+	 *
+	 * \param filename The raster filename.
+	 * \param band The band to read (1-based).
+	 * \param threads The number of threads to use. If zero, uses the hardware concurrency.
+	 */
+	RasterMask(const std::string& filename, int band = 1, int threads = 0);
+
+	/**
+	 * Return the number of columns.
+	 *
+	 * \return The number of columns.
+	 */
+	int cols() const;
+
+	/**
+	 * Return the number of rows.
+	 *
+	 * \return The number of rows.
+	 */
+	int rows() const;
+
+	/**
+	 * Return the number of set pixels.
+	 *
+	 * \return The number of set pixels.
+	 */
+	size_t count() const;
+
+	/**
+	 * Return true if the pixel is set. Pixels outside the mask are not set.
+	 *
+	 * \param col The column.
+	 * \param row The row.
+	 * \return True if the pixel is set.
+	 */
+	bool get(int col, int row) const {
+		if(col < 0 || row < 0 || col >= m_cols || row >= m_rows)
+			return false;
+		size_t tile = (size_t) (row / m_tileRows) * m_tilesX + col / m_tileCols;
+		if(!m_counts[tile])
+			return false;
+		size_t bit = (size_t) (row % m_tileRows) * m_tileCols + col % m_tileCols;
+		return (m_bits[tile * m_tileWords + bit / 64] >> (bit % 64)) & 1;
+	}
+
+	/**
+	 * Return the first column at or after col, in the given row, that lies in a tile
+	 * with any set pixels; every pixel before it is unset. Returns the number of columns
+	 * if the rest of the row is empty, and col if its own tile isn't empty.
+	 *
+	 * \param col The column.
+	 * \param row The row.
+	 * \return The first column that may be set.
+	 */
+	int emptyUntil(int col, int row) const {
+		if(row < 0 || row >= m_rows)
+			return m_cols;
+		col = std::max(0, col);
+		const uint32_t* counts = m_counts.data() + (size_t) (row / m_tileRows) * m_tilesX;
+		int tx = col / m_tileCols;
+		if(tx >= m_tilesX || counts[tx])
+			return std::min(col, m_cols);
+		while(++tx < m_tilesX && !counts[tx]);
+		return std::min(m_cols, tx * m_tileCols);
+	}
+
+	/**
+	 * Return true if no pixel in the row is set.
+	 *
+	 * \param row The row.
+	 * \return True if the row is empty.
+	 */
+	bool rowEmpty(int row) const {
+		return emptyUntil(0, row) >= m_cols;
+	}
+};
+
+/**
+ * A BIP cube stored as tiles of whole rows, each deflated into a temporary file. Before
+ * compression, a tile may be quantised to int16 with a per-tile scale and offset, but only
+ * if every value survives the round trip exactly; and the bytes of each value are
+ * shuffled into planes, which deflate compresses much better than interleaved bytes.
+ * Tiles are inflated on demand into a small least-recently-used cache. Tiles can be
+ * stored from several threads at once, but reading is not thread-safe.
+ */
+class CompressedCube {
+private:
+
+	/**
+	 * The location and encoding of a stored tile.
+	 */
+	struct Tile {
+		uint64_t offset;	///<! The offset of the tile in the file.
+		uint32_t size;		///<! The stored size of the tile.
+		bool deflated;		///<! True if the tile is deflated; otherwise it's stored shuffled but uncompressed.
+		bool quantised;		///<! True if the values are stored as int16.
+		double scale;		///<! The value is (q + shift) / scale, if quantised.
+		double shift;		///<! The value is (q + shift) / scale, if quantised.
+	};
+
+	std::unique_ptr<geo::util::TmpFile> m_file;	///<! Holds the stored tiles.
+	std::atomic<uint64_t> m_end;				///<! The end of the stored data in the file.
+	std::vector<Tile> m_tiles;					///<! The stored tiles.
+	int m_cols;									///<! The number of columns.
+	int m_rows;									///<! The number of rows.
+	int m_bands;								///<! The number of values per pixel.
+	int m_tileRows;								///<! The number of rows in a tile.
+	GDALDataType m_type;						///<! The type of the values.
+	int m_typeSize;								///<! The size in bytes of a value.
+	bool m_quantise;							///<! True to quantise tiles where it's lossless.
+	std::list<std::pair<size_t, std::vector<char>>> m_entries;	///<! The inflated tiles, most recently used first.
+	std::unordered_map<size_t, decltype(m_entries)::iterator> m_index;	///<! The inflated tiles, by index.
+	size_t m_capacity;							///<! The maximum number of inflated tiles.
+	std::vector<char> m_scratch;				///<! Holds a stored tile while it's decoded.
+
+public:
+
+	/**
+	 * Construct an empty cube.
+	 *
+	 * \param cols The number of columns.
+	 * \param rows The number of rows.
+	 * \param bands The number of values per pixel.
+	 * \param type The type of the values.
+	 * \param tileRows The number of rows in a tile.
+	 * \param quantise True to store tiles as int16 where that is lossless.
+	 * \param capacity The maximum number of inflated tiles to keep.
+	 */
+	CompressedCube(int cols, int rows, int bands, GDALDataType type, int tileRows, bool quantise, size_t capacity);
+
+	/**
+	 * Return the number of rows in a tile.
+	 *
+	 * \return The number of rows in a tile.
+	 */
+	int tileRows() const;
+
+	/**
+	 * Return the number of tiles.
+	 *
+	 * \return The number of tiles.
+	 */
+	size_t tiles() const;
+
+	/**
+	 * Return the number of rows in the given tile; the last may be short.
+	 *
+	 * \param tile The tile index.
+	 * \return The number of rows in the tile.
+	 */
+	int tileRows(size_t tile) const;
+
+	/**
+	 * Return the number of bytes written to the file so far.
+	 *
+	 * \return The number of bytes written to the file.
+	 */
+	uint64_t storedSize() const;
+
+	/**
+	 * Encode and store a tile. Each tile must be stored once; different tiles can be
+	 * stored from different threads.
+	 *
+	 * \param tile The tile index.
+	 * \param data The tile's values in BIP order. Used as scratch space; the contents are lost.
+	 * \param buf Scratch space for the encoder. Resized as needed.
+	 */
+	void put(size_t tile, std::vector<char>& data, std::vector<char>& buf);
+
+	/**
+	 * Return a pointer to the spectrum at the given pixel. The pointer remains valid
+	 * until the tile is evicted; that is, until capacity other tiles have been read.
+	 *
+	 * \param col The column.
+	 * \param row The row.
+	 * \return A pointer to the pixel's values.
+	 */
+	const char* pixel(int col, int row);
+};
+
 /**
  * An implementation of Reader that can read from GDAL data sources.
  */
@@ -225,15 +733,96 @@ private:
 	size_t m_mappedSize;		///<! The size of mapped memory for remapping an interleaved raster to a list of spectra.
 	size_t m_memLimit;			///<! The maximum amount of memory above which file-backed storage is used.
 	size_t m_mappedMinBand;		///<! The first mapped band (1-based).
-	double* m_mapped;			///<! The pointer to mapped memory for remapping an interleaved raster to a list of spectra.
+	std::vector<int> m_mappedBandList;	///<! The mapped bands, if they aren't a contiguous run; otherwise empty.
+	char* m_mapped;				///<! The pointer to mapped memory for remapping an interleaved raster to a list of spectra.
 	int m_mappedBands;			///<! The number of bands mapped into memory.
+	GDALDataType m_mappedType;	///<! The data type of the mapped values.
+	int m_mappedTypeSize;		///<! The size in bytes of a mapped value.
+	GDALDataType m_remapType;	///<! The type to store remapped values as; GDT_Unknown to keep the source type.
 	std::unique_ptr<geo::util::TmpFile> m_mappedFile;
+	bool m_remapCache;			///<! If true, remapped rasters are cached on disk and reused.
+	std::string m_remapCacheDir;	///<! The cache directory. If empty, caches are stored next to the source.
+	size_t m_mappedOffset;		///<! The offset of the mapped values in the mapping, if cached; zero otherwise.
+	bool m_mappedView;			///<! True if the mapped memory is a read-only view of a file (a remap cache or the source itself).
+	int m_mappedStride;			///<! The number of values per pixel in the mapped memory.
+	bool m_remapCompress;		///<! If true, remaps over the memory limit are stored compressed instead of spilled raw.
+	bool m_remapQuantise;		///<! If true, compressed tiles are stored as int16 where that is lossless.
+	size_t m_remapCacheTiles;	///<! The number of inflated tiles kept by the compressed store.
+	std::unique_ptr<CompressedCube> m_cube;	///<! The compressed store, if the remap is compressed.
 	double m_trans[6];
+	BlockCache m_blockCache;	///<! Caches blocks for getInt, getFloat and single-threaded sampling.
+
+	int m_prefetchRows;							///<! The number of rows in the prefetch ring; zero to read synchronously.
+	std::unique_ptr<std::thread> m_prefetch;	///<! The thread that fills the prefetch ring.
+	std::mutex m_prefetchMtx;					///<! Guards the ring state.
+	std::condition_variable m_prefetchCv;		///<! Signals changes in the ring state.
+	std::vector<std::vector<double>> m_ring;	///<! The prefetched rows, in BIP order.
+	std::vector<int> m_ringRow;					///<! The row held by each ring slot; -1 if the slot is free.
+	std::vector<bool> m_ringOk;					///<! True if the read into each slot succeeded.
+	bool m_prefetchStop;						///<! Tells the prefetch thread to quit.
+	std::vector<int> m_prefetchBands;			///<! The bands being prefetched.
+	int m_prefetchExpect;						///<! The row the consumer is expected to ask for next.
 
 	std::string m_projection;
 
 	void loadBandMap();
 
+	/**
+	 * Return the path of the remap cache file for the given band range and storage type,
+	 * and the key identifying the source in the key argument.
+	 */
+	std::string remapCachePath(const std::vector<int>& bands, GDALDataType type, std::string& key) const;
+
+	/**
+	 * Try to map an existing remap cache file. Returns true if the file exists and its key matches.
+	 */
+	bool loadRemapCache(const std::string& path, const std::string& key);
+
+	/**
+	 * If the source is a raw, uncompressed, BIP ENVI file in host byte order, map it directly
+	 * starting at the given band. Returns false if the file can't be used this way.
+	 */
+	bool mapENVI(int minBand);
+
+	/**
+	 * Remap the given bands into a compressed store.
+	 */
+	void remapCompressed(const std::vector<int>& bands, int threads);
+
+	/**
+	 * Return a pointer to the mapped spectrum at the given pixel, or nullptr if the pixel
+	 * is out of range.
+	 */
+	const char* mappedPixel(int col, int row);
+
+	/**
+	 * Start the prefetch thread at the given row, stopping any running one.
+	 */
+	void startPrefetch(int row);
+
+	/**
+	 * Stop the prefetch thread, if it is running.
+	 */
+	void stopPrefetch();
+
+	/**
+	 * Run by the prefetch thread. Reads rows into the ring from the given row on, using
+	 * its own dataset handle.
+	 */
+	void prefetch(int row);
+
+	/**
+	 * Release the mapped memory, if any.
+	 */
+	void unmap();
+
+	/**
+	 * Return the selected bands that exist in the raster, or all bands if there are none.
+	 */
+	std::vector<int> readBands() const;
+
+	bool supportsBandList() const;
+
 public:
 	/**
 	 * Construct the reader around the given filename.
@@ -251,13 +840,60 @@ public:
 	double resY() const;
 
 	/**
-	 * Remap the raster into a memory-mapped list of spectra, organized by
-	 * row/col/band. This is freed when the reader is destroyed.
+	 * Set the type used to store remapped values. By default the source type is kept,
+	 * and values are converted to double as they are read out. Setting this
+	 * to GDT_Float32, for example, halves the footprint of a Float64 raster.
+	 *
+	 * \param type The storage type, or GDT_Unknown to use the source type.
+	 */
+	void setRemapType(GDALDataType type);
+
+	/**
+	 * Enable or disable the on-disk remap cache. When enabled, the first remap of a
+	 * given source, band range and storage type is written to a cache file, and later
+	 * runs (in this process or another) map that file read-only instead of remapping.
+	 * The cache is keyed on the source path, modification time and size, so changing
+	 * the source invalidates it.
+	 *
+	 * \param enabled True to enable the cache.
+	 * \param dir The cache directory. If empty, the cache is stored next to the source.
+	 */
+	void setRemapCache(bool enabled, const std::string& dir = "");
+
+	/**
+	 * Enable or disable compressed storage for remaps that exceed the memory limit.
+	 * Instead of spilling the raw cube to a temporary file, runs of rows are deflated
+	 * into the file and inflated on demand through a small tile cache. This trades
+	 * some CPU for much less disk traffic. The on-disk remap cache, if enabled, takes
+	 * precedence.
+	 *
+	 * \param enabled True to enable compression.
+	 * \param quantise True to store tiles as int16 where that is lossless; for example,
+	 * 		integer data or reflectances with four or fewer decimal places.
+	 * \param cacheTiles The number of inflated tiles to keep.
+	 */
+	void setRemapCompression(bool enabled, bool quantise = true, size_t cacheTiles = 16);
+
+	/**
+	 * Select the bands in the wavelength range, as with setBandRange, and remap them into
+	 * a memory-mapped list of spectra, organized by row/col/band. This is freed when the
+	 * reader is destroyed.
 	 *
 	 * \param minWl the minimum wavelength of the mapped region.
 	 * \param maxWl the maximum wavelength of the mapped region.
+	 * \param threads The number of threads to use. If zero, uses the hardware concurrency.
+	 */
+	void remap(double minWl, double maxWl, int threads = 0);
+
+	/**
+	 * Remap the given bands into a memory-mapped list of spectra, organized by
+	 * row/col/band. Only those bands are read from the source. This is freed
+	 * when the reader is destroyed.
+	 *
+	 * \param bands The bands to map (1-based), in ascending order.
+	 * \param threads The number of threads to use. If zero, uses the hardware concurrency.
 	 */
-	void remap(double minWl, double maxWl);
+	void remap(const std::vector<int>& bands, int threads = 0);
 
 	/**
 	 * Remap the raster into a memory-mapped list of spectra, organized by
@@ -265,11 +901,12 @@ public:
 	 *
 	 * \param minBand the first band of the mapped region.
 	 * \param maxBand the last band of the mapped region.
+	 * \param threads The number of threads to use. If zero, uses the hardware concurrency.
 	 */
-	void remap(int minBand, int maxBand);
+	void remap(int minBand, int maxBand, int threads = 0);
 
 	/**
-	 * Remap the raster into a memory-mapped list of spectra, organized by
+	 * Remap the selected bands into a memory-mapped list of spectra, organized by
 	 * row/col/band. This is freed when the reader is destroyed.
 	 */
 	void remap();
@@ -304,6 +941,53 @@ public:
 	 */
 	bool mapped(int col, int row, std::vector<double>& values);
 
+	/**
+	 * Read a rectangular region of the raster directly from the data source into
+	 * the buffer in band-interleaved-by-pixel order; that is, the bands for each pixel are
+	 * contiguous, and pixels are stored row by row. All bands are read in a single call.
+	 * The buffer is resized to fit.
+	 *
+	 * \param col The first column.
+	 * \param row The first row.
+	 * \param cols The number of columns.
+	 * \param rows The number of rows.
+	 * \param minBand The first band to read (1-based).
+	 * \param maxBand The last band to read (1-based).
+	 * \param buf The output buffer.
+	 * \return True if the read succeeds.
+	 */
+	bool readBIP(int col, int row, int cols, int rows, int minBand, int maxBand, std::vector<double>& buf);
+
+	/**
+	 * Read a rectangular region of the given bands into the buffer in band-interleaved-by-pixel
+	 * order, as with the other readBIP. The bands needn't be contiguous; only those are read.
+	 *
+	 * \param col The first column.
+	 * \param row The first row.
+	 * \param cols The number of columns.
+	 * \param rows The number of rows.
+	 * \param bands The bands to read (1-based).
+	 * \param buf The output buffer.
+	 * \return True if the read succeeds.
+	 */
+	bool readBIP(int col, int row, int cols, int rows, const std::vector<int>& bands, std::vector<double>& buf);
+
+	/**
+	 * Get the natural block size of the raster (the block size of the first band).
+	 *
+	 * \param[out] cols The number of columns in a block.
+	 * \param[out] rows The number of rows in a block.
+	 */
+	void blockSize(int& cols, int& rows) const;
+
+	/**
+	 * Set the number of rows to read ahead on a background thread when next is
+	 * used without remapping. Zero reads each row when it is requested.
+	 *
+	 * \param rows The number of rows.
+	 */
+	void setPrefetchRows(int rows);
+
 	int toCol(double x);
 
 	int toRow(double y);
@@ -316,10 +1000,43 @@ public:
 
 	float getFloat(int col, int row);
 
+	/**
+	 * Set the number of blocks kept by the cache used for point reads.
+	 *
+	 * \param blocks The number of blocks.
+	 */
+	void setBlockCacheSize(int blocks);
+
+	/**
+	 * Sample every band of the raster at many pixels. The pixels are grouped by
+	 * block so that each block is read once, and the blocks are divided between
+	 * threads, each with its own dataset handle.
+	 *
+	 * \param cols The pixel columns.
+	 * \param rows The pixel rows.
+	 * \param values Filled with the values, pixel by pixel, one value per band. Pixels outside the raster are zero.
+	 * \param threads The number of threads to use. If zero, uses the hardware concurrency.
+	 * \return The number of pixels inside the raster.
+	 */
+	size_t sample(const std::vector<int>& cols, const std::vector<int>& rows, std::vector<double>& values, int threads = 0);
+
+	/**
+	 * Sample every band of the raster at many map coordinates. See sample(cols, rows, values, threads).
+	 *
+	 * \param xs The x coordinates.
+	 * \param ys The y coordinates.
+	 * \param values Filled with the values, point by point, one value per band. Points outside the raster are zero.
+	 * \param threads The number of threads to use. If zero, uses the hardware concurrency.
+	 * \return The number of points inside the raster.
+	 */
+	size_t sample(const std::vector<double>& xs, const std::vector<double>& ys, std::vector<double>& values, int threads = 0);
+
 	bool next(std::string& id, std::vector<double>& buf, int& cols, int& col, int& row);
 
 	bool next(std::vector<double>& buf, int band, int& cols, int& col, int& row);
 
+	bool nextBlock(SpectralBlock& block, size_t maxCount = 0);
+
 	const std::string& projection() const;
 
 	void transform(double* trans) const;
@@ -336,41 +1053,54 @@ public:
 class PointSetReader {
 private:
 	geo::ds::kdtree<hlrg::reader::Point>* m_tree;
+	std::unordered_map<uint64_t, hlrg::reader::Point*> m_cells;	///<! The first point in each occupied grid cell, keyed by column and row.
+
+	/**
+	 * Rebuild the cell index from the points' grid coordinates.
+	 */
+	void buildCells();
 
 public:
 	PointSetReader(const std::string& filename, const std::string& layer, const std::string& idField);
 	static std::vector<std::string> getLayerNames(const std::string& filename);
 	static std::vector<std::string> getFieldNames(const std::string& filename, const std::string& layer);
 	int search(double x, double y, double radius, std::vector<hlrg::reader::Point*>& pts);
-	bool sampleNear(hlrg::reader::Point& pt, double radius);
-	void toGridSpace(GDALReader* gr);
-	~PointSetReader();
-};
-
-
 
-namespace detail {
+	/**
+	 * Find the sample point nearest to the given point's grid cell, within the radius
+	 * (in cells). Small radii are resolved by probing the cell index rather than the tree.
+	 *
+	 * \param pt The point to search around. Updated with the found point.
+	 * \param radius The search radius in grid cells.
+	 * \return True if a point was found.
+	 */
+	bool sampleNear(hlrg::reader::Point& pt, double radius);
 
 	/**
-	 * A utility class representing a pixel.
+	 * Compute the grid coordinates of the points using the given raster and
+	 * rebuild the tree and the cell index.
+	 *
+	 * \param gr A raster reader.
 	 */
-	class px {
-	public:
-		int c, r;
-		std::vector<double> values;
-		px(int c, int r) :
-			c(c), r(r) {}
-		px() : px(0, 0) {}
-	};
+	void toGridSpace(GDALReader* gr);
+	~PointSetReader();
+};
 
-} // detail
 
 /**
  * An implementation of Reader that reads ENVI ROI files.
  */
 class ROIReader : public Reader {
 private:
-	std::unordered_map<long, detail::px> m_pixels;
+	std::vector<int> m_pxCols;		///<! The column of each pixel; pixels are sorted by row, then column.
+	std::vector<int> m_pxRows;		///<! The row of each pixel.
+	std::vector<double> m_values;	///<! The band values of each pixel, one pixel after another.
+	size_t m_idx;					///<! The index of the next pixel for next and nextBlock.
+
+	/**
+	 * Compute the offset of the first selected band in a pixel and the number of selected bands.
+	 */
+	void bandSpan(int& first, int& count) const;
 
 public:
 	/**
@@ -394,21 +1124,130 @@ public:
 	 */
 	bool next(std::vector<double>& buf, int& col, int& row, int& cols, int& rows);
 
+	/**
+	 * Read the next pixel in row, column order.
+	 *
+	 * \param[out] id Set to an empty string.
+	 * \param[out] buf A buffer to hold the pixel's bands.
+	 * \param[out] cols Set to 1.
+	 * \param[out] col The pixel's column.
+	 * \param[out] row The pixel's row.
+	 * \return True if a pixel was read.
+	 */
+	bool next(std::string& id, std::vector<double>& buf, int& cols, int& col, int& row);
+
+	bool nextBlock(SpectralBlock& block, size_t maxCount = 0);
+
 	~ROIReader();
 };
 
+/**
+ * An implementation of Reader that reads ENVI spectral library (.sli) files. The
+ * library is mapped into memory and each spectrum is served as a row of a single
+ * column, identified by its spectrum name.
+ */
+class SLIReader : public Reader {
+private:
+	char* m_mapped;					///<! The mapped library file.
+	size_t m_mappedSize;			///<! The size of the mapping.
+	const char* m_data;				///<! The first spectrum in the mapping.
+	GDALDataType m_type;			///<! The data type of the values.
+	int m_typeSize;					///<! The size in bytes of a value.
+	bool m_swap;					///<! True if the values are not in the host byte order.
+	std::vector<std::string> m_ids;	///<! The spectra names; empty if the header has none.
+	int m_idx;						///<! The index of the next spectrum.
+
+	/**
+	 * Compute the offset of the first selected band in a spectrum and the number of selected bands.
+	 */
+	void bandSpan(int& first, int& count) const;
+
+	/**
+	 * Convert a run of spectra to doubles.
+	 *
+	 * \param idx The index of the first spectrum.
+	 * \param count The number of spectra.
+	 * \param first The first band to copy (0-based).
+	 * \param bands The number of bands to copy.
+	 * \param out The output buffer, count * bands long.
+	 */
+	void copySpectra(size_t idx, size_t count, int first, int bands, double* out) const;
+
+public:
+
+	/**
+	 * Construct the reader around the given spectral library. The header is
+	 * found using envi::headerFile.
+	 *
+	 * \param filename A spectral library file.
+	 */
+	SLIReader(const std::string& filename);
+
+	/**
+	 * Return true if the file is an ENVI spectral library: if its header gives
+	 * the file type as a spectral library, or it has the .sli extension and a header.
+	 *
+	 * \param filename A filename.
+	 * \return True if the file is an ENVI spectral library.
+	 */
+	static bool isLibrary(const std::string& filename);
+
+	/**
+	 * Return to the first spectrum.
+	 */
+	void reset();
+
+	bool next(std::string& id, std::vector<double>& buf, int& cols, int& col, int& row);
+
+	bool nextBlock(SpectralBlock& block, size_t maxCount = 0);
+
+	~SLIReader();
+};
+
 
 /**
  * Reads the frame index time files from the Hyperspect Nano instrument.
  */
 class FrameIndexReader {
 private:
-	hlrg::ds::BinTree<long, int>* m_frames;
-	hlrg::ds::BinTree<int, long>* m_times;
+	std::vector<long> m_times;		///<! Timestamps, sorted ascending.
+	std::vector<int> m_timeFrames;	///<! The frame for each entry in m_times.
+	std::vector<int> m_frames;		///<! Frame indices, sorted ascending.
+	std::vector<long> m_frameTimes;	///<! The timestamp for each entry in m_frames.
 public:
 
 	/**
-	 * Loads the frame index into a map. Indexed by frame index (0-based, value is the GPS timestamp in us).
+	 * A lookup cursor that remembers its position in the index. Successive
+	 * queries search outward from the previous result, so a monotonic
+	 * sequence of timestamps costs amortised constant time per query.
+	 * A cursor must not outlive its reader and is not thread-safe.
+	 */
+	class Cursor {
+	private:
+		const FrameIndexReader* m_reader;
+		size_t m_pos;
+	public:
+
+		/**
+		 * Construct a cursor at the start of the given reader's index.
+		 *
+		 * \param reader The frame index reader.
+		 */
+		Cursor(const FrameIndexReader& reader);
+
+		/**
+		 * Get the frame nearest to the given timestamp.
+		 *
+		 * \param utcTime The timestamp to search for.
+		 * \param actualUtcTime A value that will be updated with the nearest timestamp to the one given.
+		 * \param frame A value that will be updated with the index of the frame.
+		 * \return True if a frame is found, false otherwise.
+		 */
+		bool getNearestFrame(long utcTime, long& actualUtcTime, int& frame);
+	};
+
+	/**
+	 * Loads the frame index into sorted arrays. Indexed by frame index (0-based, value is the GPS timestamp in us).
 	 *
 	 * \param filename The filename of the frame index file.
 	 */
@@ -456,7 +1295,26 @@ public:
 	 */
 	bool getNearestTime(int frame, int& actualFrame, long& utcTime) const;
 
-	~FrameIndexReader();
+	/**
+	 * Get the nearest frames for a list of timestamps. The list is split
+	 * into chunks which are resolved in parallel, each with its own cursor,
+	 * so sorted input is resolved in linear time.
+	 *
+	 * \param utcTimes The timestamps to search for.
+	 * \param actualUtcTimes A vector that will be filled with the nearest timestamp for each input.
+	 * \param frames A vector that will be filled with the frame for each input.
+	 * \param threads The number of threads to use. If zero, uses the hardware concurrency.
+	 * \return True if the index is not empty and the outputs were filled.
+	 */
+	bool getNearestFrames(const std::vector<long>& utcTimes, std::vector<long>& actualUtcTimes, std::vector<int>& frames, int threads = 0) const;
+
+	/**
+	 * Return a cursor on this index.
+	 *
+	 * \return A cursor on this index.
+	 */
+	Cursor cursor() const;
+
 };
 
 /**
@@ -486,27 +1344,126 @@ public:
 	 * \param msOffset A time offset to apply to the times in the rows, in milliseconds.
 	 */
 	IMUGPSRow(std::istream& in, double msOffset);
+
+	/**
+	 * Construct an empty IMUGPSRow.
+	 */
+	IMUGPSRow();
 };
 
 /**
- * Loads the APX-15 IMU/GPS table from a text file.
+ * Loads the APX-15 IMU/GPS table from a text file. The table is stored as a
+ * structure of arrays, one per column, in file order.
  */
 class IMUGPSReader {
 private:
-	std::ifstream m_in;
-	hlrg::ds::BinTree<long, IMUGPSRow*>* m_gpsTimesT;
-	hlrg::ds::BinTree<long, IMUGPSRow*>* m_utcTimesT;
-	std::vector<IMUGPSRow*> m_rows;
-	size_t m_lastIndex;
+	std::vector<long> m_gpsTime;	///<! The GPS timestamps.
+	std::vector<long> m_utcTime;	///<! The UTC timestamps (since epoch, ms), with the offset applied.
+	std::vector<double> m_roll;		///<! The platform roll.
+	std::vector<double> m_pitch;	///<! The platform pitch.
+	std::vector<double> m_yaw;		///<! The platform yaw.
+	std::vector<double> m_lat;		///<! The platform latitude.
+	std::vector<double> m_lon;		///<! The platform longitude.
+	std::vector<double> m_alt;		///<! The platform altitude.
+	std::vector<int> m_status;		///<! The status.
+	std::vector<double> m_heading;	///<! The platform heading.
+	std::vector<long> m_gpsTimes;	///<! GPS timestamps, sorted ascending.
+	std::vector<long> m_gpsUtc;		///<! The UTC timestamp for each entry in m_gpsTimes.
+	std::vector<long> m_utcTimes;	///<! UTC timestamps, sorted ascending.
+	std::vector<long> m_utcGps;		///<! The GPS timestamp for each entry in m_utcTimes.
+
+	/**
+	 * Parse the text file into the column arrays.
+	 *
+	 * \param filename The filename.
+	 */
+	void load(const std::string& filename);
+
+	/**
+	 * Load the column arrays from the binary cache if it matches the source file.
+	 *
+	 * \param path The cache path.
+	 * \param fileSize The size of the source file.
+	 * \param mtime The modification time of the source file, in nanoseconds.
+	 * \return True if the cache was loaded.
+	 */
+	bool loadCache(const std::string& path, uint64_t fileSize, int64_t mtime);
+
+	/**
+	 * Save the column arrays to the binary cache. Failures are reported but not fatal.
+	 *
+	 * \param path The cache path.
+	 * \param fileSize The size of the source file.
+	 * \param mtime The modification time of the source file, in nanoseconds.
+	 */
+	void saveCache(const std::string& path, uint64_t fileSize, int64_t mtime) const;
 
 public:
 
+	/**
+	 * A lookup cursor that remembers its position in the time indexes. Successive
+	 * queries search outward from the previous result, so a monotonic
+	 * sequence of timestamps costs amortised constant time per query.
+	 * A cursor must not outlive its reader and is not thread-safe.
+	 */
+	class Cursor {
+	private:
+		const IMUGPSReader* m_reader;
+		size_t m_gpsPos;
+		size_t m_utcPos;
+	public:
+
+		/**
+		 * Construct a cursor at the start of the given reader's indexes.
+		 *
+		 * \param reader The IMU/GPS reader.
+		 */
+		Cursor(const IMUGPSReader& reader);
+
+		/**
+		 * Compute the interpolated UTC timestamp for the given GPS timestamp.
+		 *
+		 * \param gpsTime The GPS timestamp.
+		 * \param utcTime A value that will be updated with the UTC timestamp.
+		 * \return True if the utcTime value has been set successfully.
+		 */
+		bool getUTCTime(long gpsTime, long& utcTime);
+
+		/**
+		 * Compute the interpolated GPS timestamp for the given UTC timestamp.
+		 *
+		 * \param utcTime The UTC timestamp.
+		 * \param gpsTime A value that will be updated with the GPS timestamp.
+		 * \return True if the gpsTime is updated successfully.
+		 */
+		bool getGPSTime(long utcTime, long& gpsTime);
+	};
+
 	/**
 	 * Load the file.
 	 *
 	 * \param filename The filename.
+	 * \param msOffset A time offset to apply to the UTC times, in milliseconds.
+	 * \param cache If true, the parsed table is kept in a binary cache file (filename + ".bin")
+	 * 				and reused while the source file is unchanged.
+	 */
+	IMUGPSReader(const std::string& filename, double msOffset, bool cache = false);
+
+	/**
+	 * Return the number of rows in the table.
+	 *
+	 * \return The number of rows in the table.
+	 */
+	size_t rows() const;
+
+	/**
+	 * Copy the row at the given index into the given row object.
+	 *
+	 * \param idx The row index.
+	 * \param row An IMUGPSRow to populate.
+	 * \return True if the row exists.
 	 */
-	IMUGPSReader(const std::string& filename, double msOffset);
+	bool getRow(size_t idx, IMUGPSRow& row) const;
 
 	/**
 	 * Compute and return the interpolated UTC timestamp since the epoch (Jan 1, 1970) in miliseconds.
@@ -527,7 +1484,23 @@ public:
 	 */
 	bool getGPSTime(long utcTime, long& gpsTime);
 
-	~IMUGPSReader();
+	/**
+	 * Compute the interpolated GPS timestamps for a list of UTC timestamps. The list is
+	 * split into chunks which are resolved in parallel, each with its own cursor.
+	 *
+	 * \param utcTimes The UTC timestamps.
+	 * \param gpsTimes A vector that will be filled with the GPS timestamps.
+	 * \param threads The number of threads to use. If zero, uses the hardware concurrency.
+	 * \return True if the index is not empty and the output was filled.
+	 */
+	bool getGPSTimes(const std::vector<long>& utcTimes, std::vector<long>& gpsTimes, int threads = 0) const;
+
+	/**
+	 * Return a cursor on this reader's indexes.
+	 *
+	 * \return A cursor on this reader's indexes.
+	 */
+	Cursor cursor() const;
 
 };
 
@@ -551,6 +1524,17 @@ public:
 	 * \return True if the row was read successfully.
 	 */
 	bool read(std::istream& in, double msOffset);
+
+	/**
+	 * Parse the row data from a line of text, without the line terminator.
+	 * The offset argument applies a known offst (in ms) to the times in the row.
+	 *
+	 * \param begin The start of the line.
+	 * \param end The end of the line.
+	 * \param msOffset A time offset in milliseconds.
+	 * \return True if the row was parsed successfully.
+	 */
+	bool parse(const char* begin, const char* end, double msOffset);
 };
 
 /**
@@ -561,41 +1545,137 @@ public:
  */
 class FlameReader {
 private:
-	std::ifstream m_in;		///<! The file reader.
-	double m_msOffset;		///<! The time offset in milliseconds.
-	std::string m_filename;	///<! The data file name.
+	double m_msOffset;				///<! The time offset in milliseconds.
+	std::string m_filename;			///<! The data file name.
+	std::vector<FlameRow> m_rows;	///<! The rows, if the reader is in-memory.
+	size_t m_rowIdx;				///<! The index of the next row.
+	char* m_mapped;					///<! The mapped spectral log, if the file is binary.
+	size_t m_mappedSize;			///<! The size of the mapped spectral log.
+	size_t m_recordCount;			///<! The number of records in the spectral log.
+	size_t m_recordSize;			///<! The size of a record in the spectral log.
+	char* m_text;					///<! The mapped text, if the file is a CSV.
+	size_t m_textSize;				///<! The size of the mapped text.
+	std::vector<uint64_t> m_offsets;	///<! The offset of each data row in the mapped text.
+	std::vector<int64_t> m_times;		///<! The UTC timestamp of each data row in the mapped text.
+
+	/**
+	 * Map the spectral log file and read the header and wavelengths.
+	 */
+	void loadLog();
+
+	/**
+	 * Map the CSV file, read the wavelengths from the header and build the
+	 * row offset and timestamp index in a single pass over the text.
+	 *
+	 * \param persistIndex If true, the index is loaded from, or saved to, a sidecar file.
+	 */
+	void loadText(bool persistIndex);
+
+	/**
+	 * Load the row index from the sidecar file if it matches the source file.
+	 *
+	 * \param path The sidecar path.
+	 * \param fileSize The size of the source file.
+	 * \param mtime The modification time of the source file, in nanoseconds.
+	 * \return True if the index was loaded.
+	 */
+	bool loadIndex(const std::string& path, uint64_t fileSize, int64_t mtime);
+
+	/**
+	 * Save the row index to the sidecar file. Failures are reported but not fatal.
+	 *
+	 * \param path The sidecar path.
+	 * \param fileSize The size of the source file.
+	 * \param mtime The modification time of the source file, in nanoseconds.
+	 */
+	void saveIndex(const std::string& path, uint64_t fileSize, int64_t mtime) const;
+
+	/**
+	 * Return the UTC timestamp of the given record in the spectral log.
+	 *
+	 * \param idx The record index.
+	 * \return The timestamp.
+	 */
+	long logTime(size_t idx) const;
 
 public:
 	std::vector<double> wavelengths;	///<! The list of wavelengths. TODO: This should be stored as ints.
+	std::string units;					///<! The wavelength units, if known.
 
 	/**
-	 * Construct a FlameReader using the given filename and time offset.
+	 * Construct a FlameReader using the given filename and time offset. The file may be
+	 * a convolved Flame CSV or a binary spectral log; the type is detected from the content.
+	 *
+	 * A CSV file is mapped and indexed by row offset and timestamp on construction.
 	 *
 	 * \param filename The filename of the Flame output dataset.
 	 * \param msOffset A time offset in milliseconds to apply to the times stored in each row.
+	 * \param persistIndex If true, the CSV row index is kept in a sidecar file (filename + ".idx")
+	 * 						and reused while the source file is unchanged.
+	 */
+	FlameReader(const std::string& filename, double msOffset, bool persistIndex = false);
+
+	/**
+	 * Construct an in-memory FlameReader. The wavelengths must be set and the rows
+	 * added using add before reading.
+	 *
+	 * \param msOffset A time offset in milliseconds to apply to the times stored in each row.
 	 */
-	FlameReader(const std::string& filename, double msOffset);
+	FlameReader(double msOffset);
 
 	/**
-	 * Return the number of rows in the file. This requires reading through the whole file.
+	 * Add a row to an in-memory reader.
+	 *
+	 * \param date The date string of the row, formatted as in the Flame output.
+	 * \param utcTime The UTC timestamp (ms).
+	 * \param bands The band values, one for each wavelength.
+	 */
+	void add(const std::string& date, long utcTime, const std::vector<double>& bands);
+
+	/**
+	 * Return the number of rows in the file.
 	 *
 	 * \return The number of rows in the file.
 	 */
 	int rows();
 
+	/**
+	 * Position the reader so that the next row read is the first one with a timestamp
+	 * greater than or equal to the given one.
+	 *
+	 * \param utcTime A UTC timestamp (ms).
+	 * \return True if a row was found.
+	 */
+	bool seek(long utcTime);
+
+	/**
+	 * Read the row at the given index into the given row object. Does not
+	 * change the position of the reader.
+	 *
+	 * \param idx The row index.
+	 * \param row A FlameRow instance to populate with values from the row.
+	 * \return True if the row exists and was read.
+	 */
+	bool read(size_t idx, FlameRow& row);
+
 	/**
 	 * Read the next row of data into the given row object.
 	 *
 	 * \param row A FlameRow instance to populate with values from the next row.
-	 * \return True if there is another row to read after the present row.
+	 * \return True if a row was read.
 	 */
 	bool next(FlameRow& row);
+
+	~FlameReader();
 };
 
 
 class CSVReader : public Reader {
 private:
-	std::vector<std::vector<std::string>> m_data;
+	std::vector<double> m_values;			///<! The band values of the data records, one record after another.
+	std::vector<std::string> m_ids;			///<! The identifier of each data record; empty if there's no id column.
+	std::vector<double> m_header;			///<! The wavelengths from the header row.
+	int m_width;							///<! The number of values in a record; the number of wavelength columns.
 	std::string m_filename;
 	int m_idx;
 	bool m_transpose;
@@ -606,10 +1686,13 @@ private:
 
 	void load();
 
-	void transpose();
-
 	void loadBandMap();
 
+	/**
+	 * Compute the offset of the first selected band in a record and the number of selected bands.
+	 */
+	void bandSpan(int& first, int& count) const;
+
 public:
 	CSVReader(const std::string& filename, bool transpose, int headerRows, int minWlCol, int maxWlCol, int idCol);
 
@@ -634,6 +1717,115 @@ public:
 
 	bool next(std::string& id, std::vector<double>& buf, int& cols, int& col, int& row);
 
+	bool nextBlock(SpectralBlock& block, size_t maxCount = 0);
+
+};
+
+/**
+ * A Reader that wraps another and reads ahead from it on a background thread into a
+ * bounded queue, so that storage latency overlaps the consumer's work. The thread is
+ * started by the first call to next or nextBlock; whichever is called first is the
+ * only one that may be used afterwards. Band settings are passed through to the wrapped
+ * reader and should be made before reading, since they discard anything read ahead.
+ * Blocks are always copied, because the wrapped reader's memory changes as it reads.
+ */
+class PrefetchReader : public Reader {
+private:
+
+	/**
+	 * The result of one call to the wrapped reader.
+	 */
+	struct Item {
+		SpectralBlock block;	///<! The spectra from nextBlock; or, from next, the buffer in block.buf.
+		std::string id;			///<! The identifier from next.
+		int cols;				///<! The number of columns from next.
+		int col;				///<! The column from next.
+		int row;				///<! The row from next.
+		bool ok;				///<! The wrapped reader's return value.
+	};
+
+	/**
+	 * The method used to read from the wrapped reader.
+	 */
+	enum class Mode {
+		None,
+		Next,
+		NextBlock
+	};
+
+	std::unique_ptr<Reader> m_reader;			///<! The wrapped reader.
+	size_t m_depth;								///<! The maximum number of items read ahead.
+	Mode m_mode;								///<! The method in use.
+	size_t m_maxCount;							///<! The maximum count passed to the wrapped nextBlock.
+	std::unique_ptr<std::thread> m_thread;		///<! The thread that reads ahead.
+	std::mutex m_mtx;							///<! Guards the queue state.
+	std::condition_variable m_cv;				///<! Signals changes in the queue state.
+	std::vector<Item> m_ring;					///<! The items read ahead; item i is in slot i % depth.
+	size_t m_filled;							///<! The number of items read.
+	size_t m_taken;								///<! The number of items taken by the consumer.
+	bool m_done;								///<! True when the wrapped reader has no more items.
+	bool m_stop;								///<! Tells the thread to quit.
+	std::exception_ptr m_error;					///<! The exception thrown by the wrapped reader, if any.
+
+	/**
+	 * Copy the wrapped reader's shape and band settings.
+	 */
+	void sync();
+
+	/**
+	 * Start the thread in the given mode.
+	 */
+	void start(Mode mode);
+
+	/**
+	 * Stop the thread and discard anything read ahead.
+	 */
+	void stop();
+
+	/**
+	 * Run by the thread. Fills the queue until the wrapped reader is exhausted or stop is called.
+	 */
+	void run();
+
+	/**
+	 * Wait for the next item and lock it for the consumer. Returns the slot, or -1 at the end.
+	 */
+	int take(std::unique_lock<std::mutex>& lk);
+
+public:
+
+	/**
+	 * Wrap the given reader.
+	 *
+	 * \param reader The reader to read from. The PrefetchReader takes ownership.
+	 * \param depth The number of rows or blocks to read ahead.
+	 */
+	PrefetchReader(std::unique_ptr<Reader> reader, size_t depth = 4);
+
+	/**
+	 * Return the wrapped reader; for example, to configure a GDALReader's remap. It
+	 * must not be read from directly.
+	 *
+	 * \return The wrapped reader.
+	 */
+	Reader* reader() const;
+
+	void setBufSize(int bufSize);
+
+	void setBandMap(const std::map<int, int>& map);
+
+	void setBandRange(double min, double max);
+
+	void setBands(const std::vector<int>& bands);
+
+	bool next(std::string& id, std::vector<double>& buf, int& cols, int& col, int& row);
+
+	/**
+	 * Read the next block. The maxCount given to the first call is used for the whole run.
+	 */
+	bool nextBlock(SpectralBlock& block, size_t maxCount = 0);
+
+	~PrefetchReader();
 };
 
 } // reader
@@ -11,6 +11,11 @@
 #include <string>
 
 namespace hlrg {
+
+namespace reader {
+	class FlameReader;
+}
+
 namespace reflectance {
 
 class Reflectance;
@@ -44,6 +49,8 @@ public:
 	 * @param irradUTCOffset A time offset to convert the timestamps in the irradiance spectrometer to match those from the APX-15.
 	 * @param reflOut An output image for the reflectance.
 	 * @param running Method will continue so long as this is set to true or until completion.
+	 * @param imuCache If true, the parsed IMUGPS table is cached in a binary file next to imuGps.
+	 * @param persistIndex If true, the row index of irradConv is kept in a sidecar file next to it.
 	 */
 	void run(ReflectanceListener& listener,
 			const std::string& imuGps, double imuUTCOffset,
@@ -51,7 +58,31 @@ public:
 			const std::string& frameIdx,
 			const std::string& irradConv, double irradUTCOffset,
 			const std::string& reflOut,
-			bool& running);
+			bool& running, bool imuCache = false, bool persistIndex = false);
+
+	/**
+	 * Processes the radiance image and convolved irradiance spectra to produce a
+	 * reflectance image with the same characteristics as the radiance image. The
+	 * convolved irradiance is read from the given FlameReader, which may have been
+	 * populated in memory by the convolve stage.
+	 *
+	 * @param imuGps The imu_gps.txt file produced by the APX-15. This provides a mapping between the GPS
+	 * timestamp and the UTC date/time.
+	 * @param imuUTCOffset This provides a way of offsetting the UTC timestamp from the APX. Usually not needed. Decimal hours.
+	 * @param rawRad The raw radiance image.
+	 * @param frameIdx The frame index file produced by the Nano Hyperspec.
+	 * @param irrad A reader for the irradiance spectra convolved to correspond to the band map of the Nano.
+	 * @param reflOut An output image for the reflectance.
+	 * @param running Method will continue so long as this is set to true or until completion.
+	 * @param imuCache If true, the parsed IMUGPS table is cached in a binary file next to imuGps.
+	 */
+	void run(ReflectanceListener& listener,
+			const std::string& imuGps, double imuUTCOffset,
+			const std::string& rawRad,
+			const std::string& frameIdx,
+			hlrg::reader::FlameReader& irrad,
+			const std::string& reflOut,
+			bool& running, bool imuCache = false);
 
 	double progress() const;
 
@@ -10,6 +10,8 @@
 
 #include <vector>
 #include <string>
+#include <fstream>
+#include <cstdint>
 
 #include <gdal_priv.h>
 
@@ -180,6 +182,42 @@ public:
 	~CSVWriter();
 };
 
+/**
+ * Writes convolved spectra to the binary spectral log format described
+ * in hlrg::reader::slog. Each record holds the date and UTC time in milliseconds
+ * followed by the band values as 32-bit floats. The record count is written
+ * to the header when the writer is destroyed.
+ */
+class SpectralLogWriter {
+private:
+	std::ofstream m_output;		///<! Output file stream.
+	size_t m_bands;				///<! The number of bands in each record.
+	uint64_t m_records;			///<! The number of records written.
+	std::vector<float> m_buf;	///<! A buffer for converting values.
+
+public:
+
+	/**
+	 * Construct a SpectralLogWriter.
+	 *
+	 * \param filename The output file name.
+	 * \param wavelengths A list of the wavelengths corresponding to each band.
+	 * \param unit The wavelength units.
+	 */
+	SpectralLogWriter(const std::string& filename, const std::vector<double>& wavelengths, const std::string& unit = "nm");
+
+	/**
+	 * Write a record.
+	 *
+	 * \param dateTime The record's local date/time in milliseconds.
+	 * \param utcTime The record's GPS/UTC time in milliseconds.
+	 * \param values The band values. Must have as many elements as there are wavelengths.
+	 */
+	void write(long dateTime, long utcTime, const std::vector<double>& values);
+
+	~SpectralLogWriter();
+};
+
 } // writer
 } // hlrg
 
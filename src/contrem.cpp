@@ -31,8 +31,18 @@ using namespace geo::util;
 
 namespace {
 
-	std::unique_ptr<Reader> getReader(const std::string& file, bool transpose, int headerRows, int minCol, int maxCol, int idCol) {
+	constexpr size_t PREFETCH_DEPTH = 4;	///<! The number of blocks read ahead of the processing loop.
+
+	/**
+	 * Open a reader for the given file, wrapped in a PrefetchReader so that reads
+	 * overlap processing.
+	 */
+	std::unique_ptr<PrefetchReader> getReader(const std::string& file, bool transpose, int headerRows, int minCol, int maxCol, int idCol) {
 		std::unique_ptr<Reader> rdr;
+		if(SLIReader::isLibrary(file)) {
+			rdr.reset(new SLIReader(file));
+			return std::unique_ptr<PrefetchReader>(new PrefetchReader(std::move(rdr), PREFETCH_DEPTH));
+		}
 		FileType type = getFileType(file);
 		switch(type) {
 		case FileType::CSV:
@@ -49,7 +59,7 @@ namespace {
 		default:
 			throw std::runtime_error("Unknown file type for " + file);
 		}
-		return rdr;
+		return std::unique_ptr<PrefetchReader>(new PrefetchReader(std::move(rdr), PREFETCH_DEPTH));
 	}
 
 	/**
@@ -693,6 +703,8 @@ Contrem::Contrem() :
 		onlySamples(false),
 		normMethod(NormMethod::ConvexHull),
 		threads(1),
+		remapCache(false),
+		remapCompress(false),
 		running(false),
 		grdr(nullptr) {}
 
@@ -711,10 +723,11 @@ void Contrem::run(ContremListener* listener) {
 
 	std::cout << "Remapping...\n";
 
-	std::unique_ptr<Reader> reader = getReader(spectra, wlTranspose, wlHeaderRows, wlMinCol, wlMaxCol, wlIDCol);
+	std::unique_ptr<PrefetchReader> reader = getReader(spectra, wlTranspose, wlHeaderRows, wlMinCol, wlMaxCol, wlIDCol);
 	reader->setBandRange(minWl, maxWl);
-	if(reader->fileType() != FileType::CSV) {
-		grdr = static_cast<GDALReader*>(reader.get());
+	if((grdr = dynamic_cast<GDALReader*>(reader->reader()))) {
+		grdr->setRemapCache(remapCache, remapCacheDir);
+		grdr->setRemapCompression(remapCompress);
 		grdr->remap(minWl, maxWl);
 	}
 
@@ -724,7 +737,7 @@ void Contrem::run(ContremListener* listener) {
 	config.cols = reader->cols();
 	config.rows = reader->rows();
 	config.bands = reader->bands();
-	config.useROI = getFileType(spectra) != FileType::CSV;
+	config.useROI = grdr != nullptr;
 
 	// A list of wavelengths.
 	config.wavelengths = reader->getWavelengths();
@@ -753,46 +766,28 @@ void Contrem::run(ContremListener* listener) {
 	nextStep();
 
 	// Check for a mask file.
-	bool hasRoi = false;
-	std::vector<bool> mask;
-	{
-		if(config.useROI && !roi.empty() && isfile(roi)) {
-			try {
-				GDALReader rdr(roi);
-				int col, row, cols = 1;
-				std::string id;
-				std::vector<double> buf(rdr.cols());
-				mask.resize(rdr.cols() * rdr.rows());
-				while(running && rdr.next(buf, 1, cols, col, row)) {
-					for(int i = 0; i < cols; ++i)
-						mask[row * cols + i] = buf[i] > 0;
-				}
-				hasRoi = true;
-			} catch(const std::exception& ex) {
-				std::cerr << "Could not open mask: " << ex.what() << "\n";
-			}
+	std::unique_ptr<RasterMask> mask;
+	if(config.useROI && !roi.empty() && isfile(roi)) {
+		try {
+			mask.reset(new RasterMask(roi, 1, threads));
+		} catch(const std::exception& ex) {
+			std::cerr << "Could not open mask: " << ex.what() << "\n";
 		}
 	}
+	bool hasRoi = mask != nullptr;
 
 	nextStep();
 
 	// Determine the number of steps for status-keeping.
 	{
 		int steps = 0;
-		switch(getFileType(spectra)) {
-		case FileType::CSV:
+		if(!grdr) {
+			// Lists of spectra: CSV files and spectral libraries.
 			steps = reader->rows();
-			break;
-		case FileType::GTiff:
-		case FileType::ENVI:
-			if(hasRoi) {
-				steps = std::count(mask.begin(), mask.end(), true);
-			} else {
-				steps = reader->rows() * reader->cols();
-			}
-			break;
-		default:
-			break;
+		} else if(hasRoi) {
+			steps = (int) mask->count();
+		} else {
+			steps = reader->rows() * reader->cols();
 		}
 
 		// Each datum goes through three steps; 1) adding to the queue; 2) processing; 3) writing.
@@ -802,44 +797,56 @@ void Contrem::run(ContremListener* listener) {
 
 	// If there's a sample points file and a raster reader, we can use the sample points.
 	config.hasSamples = false;
-	if(!samplePoints.empty() && static_cast<GDALReader*>(reader.get())) {
+	if(!samplePoints.empty() && grdr) {
 		config.samples.reset(new PointSetReader(samplePoints, samplePointsLayer, samplePointsIDField));
-		config.samples->toGridSpace(static_cast<GDALReader*>(reader.get()));
+		config.samples->toGridSpace(grdr);
 		config.hasSamples = true;
 	}
 
-	// A buffer for input data. Stores a row from a raster, or a single "pixel" from a table.
-	std::vector<double> buf(config.cols * reader->bands());
-
-	// Read through the buffer and populate the input queue.
+	// Read through the input a block of spectra at a time and populate the input queue.
 	int bands = reader->bands();
-	int cols, col, row;
 	hlrg::reader::Point pt;
-	std::string id;
-	while(running && reader->next(id, buf, cols, col, row)) {
+	SpectralBlock block;
+	while(running && reader->nextBlock(block, 1024)) {
 
+		int nb = std::min({bands, block.bands, (int) config.wavelengths.size()});
 		{
-			nextStep();
-
 			// Read out the input objects and add to the queue.
 			std::lock_guard<std::mutex> lk(config.inmtx);
 
-			// If there's a mask, check it. Skip if necessary.
-			if(hasRoi && !mask[row * cols + col])
-				continue;
+			for(size_t i = 0; i < block.count; ++i) {
+				int col = block.cols[i];
+				int row = block.rows[i];
+
+				// If there's a mask, check it. Skip if necessary. Masked pixels aren't
+				// counted in the steps.
+				if(hasRoi && !mask->get(col, row)) {
+					// Skip the rest of the run of pixels in empty tiles. Blocks are usually
+					// consecutive pixels, so jump straight to the end of the run if it's there.
+					int end = mask->emptyUntil(col, row);
+					size_t n = std::min((size_t) std::max(0, end - col - 1), block.count - i - 1);
+					if(n && block.rows[i + n] == row && block.cols[i + n] == col + (int) n) {
+						i += n;
+					} else {
+						while(i + 1 < block.count && block.rows[i + 1] == row && block.cols[i + 1] > col && block.cols[i + 1] < end)
+							col = block.cols[++i];
+					}
+					continue;
+				}
 
-			pt.c(col);
-			pt.r(row);
-			if(config.hasSamples && !config.samples->sampleNear(pt, 1.0))
-				continue;
+				nextStep();
+
+				pt.c(col);
+				pt.r(row);
+				if(config.hasSamples && !config.samples->sampleNear(pt, 1.0))
+					continue;
 
-			input in(id, col, row);
-			for(int b = 0; b < bands; ++b) {
-				double v = buf[b];
-				double w = config.wavelengths[b];
-				in.data.emplace_back(w, v);
+				input in(block.ids.empty() ? "" : block.ids[i], col, row);
+				const double* spec = block.spectrum(i);
+				for(int b = 0; b < nb; ++b)
+					in.data.emplace_back(config.wavelengths[b], spec[b]);
+				config.inqueue.push_back(in);
 			}
-			config.inqueue.push_back(in);
 		}
 
 		// Notify the input processor.
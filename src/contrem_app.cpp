@@ -85,6 +85,10 @@ void usage() {
 			<< " -h  The maximum wavelength to consider.\n"
 			<< " -t  The number of threads to use. Default 2.\n"
 			<< " -nm Normalization method. ConvexHull, ConvexHullLongestSeg or Line.\n"
+			<< " -rc Cache the remapped raster next to the input, and reuse it on later runs.\n"
+			<< " -rd Cache the remapped raster in the given directory, and reuse it on later runs.\n"
+			<< " -rz Store the remapped raster in losslessly compressed tiles instead of a raw temporary file.\n"
+			<< "     -rc and -rd take precedence; -rz only applies when the raster isn't cached.\n"
 			<< "Run without arguments for GUI version.\n";
 }
 
@@ -149,6 +153,13 @@ int main(int argc, char** argv) {
 					}
 				} else if(arg == "-t") {
 					contrem.threads = atoi(argv[++i]);
+				} else if(arg == "-rc") {
+					contrem.remapCache = true;
+				} else if(arg == "-rd") {
+					contrem.remapCache = true;
+					contrem.remapCacheDir = argv[++i];
+				} else if(arg == "-rz") {
+					contrem.remapCompress = true;
 				} else if(arg == "-nm") {
 					std::string d(argv[++i]);
 					if(d == "ConvexHull") {
@@ -15,6 +15,13 @@
 #include <limits>
 #include <thread>
 #include <atomic>
+#include <future>
+#include <chrono>
+#include <mutex>
+#include <list>
+#include <algorithm>
+#include <iomanip>
+#include <ctime>
 
 #include "convolve.hpp"
 #include "writer.hpp"
@@ -41,164 +48,188 @@ namespace {
 	}
 
 	/**
-	 * Binary search tree for locating the Kernel whose mean is nearest
-	 * a given wavelength.
+	 * Holds the band definitions and kernels for a convolution, and the
+	 * output spectrum that receives each convolved record.
 	 */
-	class BinTree {
+	class Convolver {
 	private:
-		BinTree* left;
-		BinTree* right;
-		const Kernel* kernel;
+		BandPropsReader m_props;
+		KernelSet m_kernels;
+		double m_tolerance;
 
-		/**
-		 * Return the Kernel nearest the given key, be it a or b.
-		 *
-		 * \param key A key.
-		 * \param a A Kernel.
-		 * \param b A Kernel.
-		 * \return The nearest Kernel.
-		 */
-		const Kernel& closer(double key, const Kernel& a, const Kernel& b) {
-			if(std::abs(key - a.wl()) < std::abs(key - b.wl())) {
-				return a;
-			} else {
-				return b;
-			}
-		}
+	public:
+		Spectrum out;	///<! The convolved spectrum; updated by apply.
 
 		/**
-		 * Initialize with a (sorted) kernel array.
+		 * Load the band definition file. The kernels are built on the first call to apply,
+		 * and rebuilt only if the input bands change.
 		 *
-		 * \param k The sorted Kernel array.
-		 * \param start The start index.
-		 * \param end The ending index.
+		 * \param bandDef The band definition file.
+		 * \param bandDefDelim The band definition file delimiter.
+		 * \param tolerance The Gaussian threshold that determines the kernel support.
 		 */
-		void init(const std::vector<Kernel>& k, int start, int end) {
-			int mid = (end + start) / 2;
-			kernel = &k[mid];
-			if(mid > start) {
-				left = new BinTree();
-				left->init(k, start, mid);
-			}
-			if(end > mid + 1) {
-				right = new BinTree();
-				right->init(k, mid + 1, end);
-			}
+		Convolver(const std::string& bandDef, const std::string& bandDefDelim, double tolerance) :
+			m_tolerance(tolerance) {
+			m_props.load(bandDef, bandDefDelim);
+			m_props.configureSpectrum(out);
 		}
 
-	public:
-
 		/**
-		 * Create a BinTree.
+		 * Return the band definitions.
+		 *
+		 * \return The band definitions.
 		 */
-		BinTree() :
-			left(nullptr), right(nullptr), kernel(nullptr) {
+		const BandPropsReader& props() const {
+			return m_props;
 		}
 
 		/**
-		 * Initialize with the given (sorted) vector.
+		 * Convolve the current record of the given spectrum into the output spectrum.
 		 *
-		 * \param k A sorted Kernel vector.
+		 * \param spec An input spectrum.
 		 */
-		void init(const std::vector<Kernel>& k) {
-			init(k, 0, (int) k.size());
+		void apply(const Spectrum& spec) {
+			if(!m_kernels.matches(spec.bands))
+				m_kernels.build(m_props.bands(), spec.bands, m_tolerance);
+
+			// Reset the output
+			out.reset();
+			out.date = spec.date;
+			out.time = spec.time;
+			out.dateTime = spec.dateTime;
+
+			m_kernels.apply(spec.intensities.data(), out.intensities.data());
 		}
 
 		/**
-		 * Find the Kernel nearest the given key.
+		 * Restrict the spectrum to the input bands that the kernels use, so that
+		 * a raster's other bands are never read. The output is unchanged.
 		 *
-		 * \param key The key.
-		 * \return A reference to the nearest Kernel.
+		 * \param spec An input spectrum.
 		 */
-		const Kernel& find(double key) {
-			if(key == kernel->wl()) {
-				return *kernel;
-			} else if(key < kernel->wl()) {
-				return left ? closer(key, *kernel, left->find(key)) : *kernel;
-			} else {
-				return right ? closer(key, *kernel, right->find(key)) : *kernel;
-			}
+		void select(Spectrum& spec) {
+			if(!m_kernels.matches(spec.bands))
+				m_kernels.build(m_props.bands(), spec.bands, m_tolerance);
+			spec.selectBands(m_kernels.inputs());
 		}
-
-		~BinTree() {
-			if(left) delete left;
-			if(right) delete right;
-		}
-
-
 	};
 
 } // anon
 
 
 
-Kernel::Kernel(double wl, double fwhm, int window, int index) :
-	m_wl(wl),
-	m_fwhm(fwhm),
-	m_window(window),
-	m_index(index) {
-
-	// Calculate the std. dev from FWHM.
-	double sigma = std::sqrt(fwhm / (2.0 * std::sqrt(2.0 * std::log(2.0))));
-
-	int mid = m_window / 2;
-	double sum = 0;
-
-	m_kernel.resize(m_window);
+void KernelSet::build(const std::map<int, BandProp>& props, const std::vector<Band>& inputs, double tolerance) {
+	if(tolerance >= 1)
+		throw std::runtime_error("The tolerance must be less than 1.");
 
-	// Calculate the coefficients and add to sum.
-	for(int i = 0; i < m_window; ++i)
-		sum += (m_kernel[i] = std::exp(-0.5 * std::pow((i - mid) / sigma, 2.0)));
-
-	// Normalize.
-	for(int i = 0; i < m_window; ++i)
-		m_kernel[i] /= sum;
-}
-
-Kernel::~Kernel() {
-}
+	size_t n = inputs.size();
+	m_inputWl.resize(n);
+	m_inputScale.resize(n);
+	for(size_t i = 0; i < n; ++i) {
+		m_inputWl[i] = inputs[i].wl();
+		m_inputScale[i] = inputs[i].scale();
+	}
 
-int Kernel::index() const {
-	return m_index;
-}
+	m_offset.clear();
+	m_first.clear();
+	m_count.clear();
+	m_weights.clear();
+
+	for(const auto& it : props) {
+		const BandProp& p = it.second;
+		m_offset.push_back(m_weights.size());
+
+		// Calculate the std. dev from FWHM, and the distance at which the Gaussian drops below the tolerance.
+		double sigma = p.fwhm / (2.0 * std::sqrt(2.0 * std::log(2.0)));
+		double radius = tolerance > 0 ? sigma * std::sqrt(-2.0 * std::log(tolerance)) : std::numeric_limits<double>::max();
+
+		// Find the run of input bands within the support.
+		int first = -1, last = -1;
+		for(size_t i = 0; i < n; ++i) {
+			if(std::abs(m_inputWl[i] - p.wl) <= radius) {
+				if(first == -1) first = (int) i;
+				last = (int) i;
+			}
+		}
 
-void Kernel::setWavelength(double wl) {
-	m_wl = wl;
-}
+		if(first == -1 || sigma <= 0) {
+			// With no width, or no input within reach, fall back to the nearest input band.
+			int nearest = -1;
+			for(size_t i = 0; i < n; ++i) {
+				if(nearest == -1 || std::abs(m_inputWl[i] - p.wl) < std::abs(m_inputWl[nearest] - p.wl))
+					nearest = (int) i;
+			}
+			if(sigma <= 0 && nearest != -1) {
+				m_first.push_back(nearest);
+				m_count.push_back(1);
+				m_weights.push_back(m_inputScale[nearest]);
+			} else {
+				m_first.push_back(0);
+				m_count.push_back(0);
+			}
+			continue;
+		}
 
-double Kernel::wl() const {
-	return m_wl;
-}
+		// Calculate the coefficients; unsorted inputs may leave pruned taps inside the run.
+		double sum = 0;
+		for(int i = first; i <= last; ++i) {
+			double d = m_inputWl[i] - p.wl;
+			double w = std::abs(d) <= radius ? std::exp(-0.5 * std::pow(d / sigma, 2.0)) : 0;
+			m_weights.push_back(w);
+			sum += w;
+		}
 
-void Kernel::setFWHM(double fwhm) {
-	m_fwhm = fwhm;
-}
+		// Normalize, and fold in the input scale.
+		size_t offset = m_offset.back();
+		for(int i = first; i <= last; ++i)
+			m_weights[offset + i - first] = m_weights[offset + i - first] / sum * m_inputScale[i];
 
-double Kernel::fwhm() const {
-	return m_fwhm;
+		m_first.push_back(first);
+		m_count.push_back(last - first + 1);
+	}
 }
 
-void Kernel::setWindow(int window) {
-	m_window = window;
+bool KernelSet::matches(const std::vector<Band>& inputs) const {
+	if(inputs.size() != m_inputWl.size() || m_offset.empty())
+		return false;
+	for(size_t i = 0; i < inputs.size(); ++i) {
+		if(inputs[i].wl() != m_inputWl[i] || inputs[i].scale() != m_inputScale[i])
+			return false;
+	}
+	return true;
 }
 
-int Kernel::window() const {
-	return m_window;
+void KernelSet::apply(const double* input, double* output) const {
+	for(size_t k = 0; k < m_first.size(); ++k) {
+		const double* w = m_weights.data() + m_offset[k];
+		const double* in = input + m_first[k];
+		int count = m_count[k];
+		double sum = 0;
+		#pragma omp simd reduction(+:sum)
+		for(int j = 0; j < count; ++j)
+			sum += w[j] * in[j];
+		output[k] = sum;
+	}
 }
 
-double Kernel::apply(const std::vector<double>& intensities, const std::vector<double>& /*wavelengths*/, int idx) const {
-	double out = 0;
-	int max = (int) intensities.size();
-	for(int i = 0; i < m_window; ++i) {
-		int j = idx + i - m_window / 2;
-		if(j >= 0 && j < max)
-			out += intensities[j] * m_kernel[i];
+std::vector<int> KernelSet::inputs() const {
+	std::vector<bool> used(m_inputWl.size(), false);
+	for(size_t k = 0; k < m_first.size(); ++k) {
+		for(int j = 0; j < m_count[k]; ++j) {
+			if(m_weights[m_offset[k] + j] != 0)
+				used[m_first[k] + j] = true;
+		}
 	}
-	return out;
+	std::vector<int> idx;
+	for(size_t i = 0; i < used.size(); ++i) {
+		if(used[i])
+			idx.push_back((int) i);
+	}
+	return idx;
 }
 
-bool Kernel::operator<(const Kernel& other) const {
-	return wl() < other.wl();
+size_t KernelSet::taps() const {
+	return m_weights.size();
 }
 
 
@@ -258,7 +289,8 @@ Spectrum::Spectrum(int firstRow, int firstCol, int dateCol, int timeCol) :
 		m_dateCol(dateCol), m_timeCol(timeCol),
 		m_col(0), m_row(0),
 		m_rasterIdx(0),
-		time(0) {}
+		m_blockIdx(0),
+		time(0), dateTime(0) {}
 
 Spectrum::Spectrum() : Spectrum(0, 0, -1, -1) {}
 
@@ -271,7 +303,9 @@ size_t Spectrum::inputSize(const std::string& filename, const std::string& /*del
 bool Spectrum::load(const std::string& filename, const std::string& delimiter, size_t memLimit) {
 	// Clear any existing bands list.
 	bands.clear();
-	if(getFileType(filename) == FileType::CSV) {
+	if(slog::isSpectralLog(filename)) {
+		return loadLog(filename);
+	} else if(getFileType(filename) == FileType::CSV) {
 		return loadCSV(filename, delimiter);
 	} else {
 		return loadRaster(filename, memLimit);
@@ -280,10 +314,9 @@ bool Spectrum::load(const std::string& filename, const std::string& delimiter, s
 
 bool Spectrum::loadRaster(const std::string& filename, size_t memLimit) {
 
-	m_raster.reset(new GDALReader(filename, memLimit));
+	m_raster.reset(new GDALReader(filename));
 	m_projection = m_raster->projection();
 	m_raster->transform(m_trans);
-	m_raster->remap();
 	std::vector<double> bandRange = m_raster->getWavelengths();
 
 	for(double b : bandRange) {
@@ -293,7 +326,21 @@ bool Spectrum::loadRaster(const std::string& filename, size_t memLimit) {
 
 	intensities.resize(wavelengths.size());
 
-	m_count = m_raster->cols() * m_raster->rows();
+	m_count = (size_t) m_raster->cols() * m_raster->rows();
+
+	// The raster is streamed a row at a time, with the reader prefetching at least one
+	// block's worth of rows on a background thread. If there's a memory limit, read
+	// further ahead to use it.
+	int bcols, brows;
+	m_raster->blockSize(bcols, brows);
+	int ahead = std::max(1, brows);
+	if(memLimit > 0) {
+		size_t rowSize = (size_t) m_raster->cols() * wavelengths.size() * sizeof(double);
+		ahead = std::max(ahead, (int) std::min((size_t) m_raster->rows(), memLimit / rowSize));
+	}
+	m_raster->setPrefetchRows(ahead);
+	m_block.count = 0;
+	m_blockIdx = 0;
 
 	return true;
 }
@@ -357,6 +404,17 @@ bool Spectrum::loadCSV(const std::string& filename, const std::string& delimiter
 	return true;
 }
 
+bool Spectrum::loadLog(const std::string& filename) {
+	m_log.reset(new FlameReader(filename, 0));
+	for(double wl : m_log->wavelengths) {
+		bands.emplace_back(wl, 0);
+		wavelengths.push_back(wl);
+	}
+	intensities.resize(wavelengths.size());
+	m_count = m_log->rows();
+	return m_count > 0;
+}
+
 size_t Spectrum::count() const {
 	return m_count;
 }
@@ -373,16 +431,48 @@ bool Spectrum::next() {
 
 	if(m_raster.get()) {
 
-		if(m_rasterIdx < m_count) {
-			m_col = m_rasterIdx % m_raster->cols();
-			m_row = m_rasterIdx / m_raster->cols();
-			if(!m_raster->mapped(m_col, m_row, intensities))
-				std::cerr << "Warning: failed to read mapped values at " << m_col << ", " << m_row << "\n";
-			++m_rasterIdx;
-			return true;
-		} else {
-			return false;
+		if(m_blockIdx >= m_block.count) {
+			m_blockIdx = 0;
+			if(!m_raster->nextBlock(m_block)) {
+				if(m_rasterIdx >= m_count) {
+					m_block.count = 0;
+					return false;
+				}
+				// A failed read; carry on with a row of zeros.
+				int cols = m_raster->cols();
+				int row = (int) (m_rasterIdx / cols);
+				std::cerr << "Warning: failed to read row " << row << "\n";
+				m_block.resize(cols, (int) intensities.size());
+				std::fill(m_block.buf.begin(), m_block.buf.end(), 0);
+				for(int c = 0; c < cols; ++c) {
+					m_block.cols[c] = c;
+					m_block.rows[c] = row;
+				}
+			}
 		}
+		const double* px = m_block.spectrum(m_blockIdx);
+		std::copy(px, px + std::min((size_t) m_block.bands, intensities.size()), intensities.begin());
+		m_col = m_block.cols[m_blockIdx];
+		m_row = m_block.rows[m_blockIdx];
+		++m_blockIdx;
+		++m_rasterIdx;
+		return true;
+
+	} else if(m_log.get()) {
+
+		if(!m_log->next(m_logRow))
+			return false;
+		dateTime = m_logRow.dateTime;
+		time = m_logRow.utcTime;
+		std::copy(m_logRow.bands.begin(), m_logRow.bands.end(), intensities.begin());
+		// Recover the date string for text output.
+		time_t secs = dateTime / 1000;
+		std::tm t;
+		gmtime_r(&secs, &t);
+		std::stringstream ss;
+		ss << std::put_time(&t, "%Y-%m-%d %H:%M:%S") << '.' << std::setw(3) << std::setfill('0') << (dateTime % 1000);
+		date = ss.str();
+		return true;
 
 	} else {
 
@@ -453,6 +543,10 @@ std::unique_ptr<GDALReader>& Spectrum::raster() {
 	return m_raster;
 }
 
+std::string Spectrum::units() const {
+	return m_log.get() ? m_log->units : "";
+}
+
 void Spectrum::writeHeader(std::ostream& out, double minWl, double maxWl, char delim) {
 	out << "date,timestamp";
 	for(const Band& b : bands) {
@@ -483,6 +577,19 @@ void Spectrum::write(GDALWriter* wtr, double minWl, double maxWl, int col, int r
 		std::cerr << "Failed to write at " << col << ", " << row << "\n";
 }
 
+void Spectrum::write(SpectralLogWriter* wtr, double minWl, double maxWl) {
+	std::vector<double> v;
+	for(size_t i = 0; i < bands.size(); ++i) {
+		const Band& b = bands[i];
+		if(b.wl() >= minWl && b.wl() <= maxWl)
+			v.push_back(intensities[i]);
+	}
+	long dt = dateTime;
+	if(!dt && !date.empty() && !parseUTCMilSec(date, dt))
+		dt = 0;
+	wtr->write(dt, time, v);
+}
+
 void Spectrum::scale(double scale) {
 	for(Band& b : bands)
 		b.setScale(scale);
@@ -493,6 +600,27 @@ void Spectrum::shift(double shift) {
 		b.setShift(shift);
 }
 
+void Spectrum::selectBands(const std::vector<int>& idx) {
+	if(!m_raster || idx.empty() || idx.size() == bands.size())
+		return;
+	// The bands are in the order of the raster's selection.
+	std::vector<int> rasterBands = m_raster->selectedBands();
+	if(rasterBands.size() != bands.size())
+		return;
+	std::vector<int> sel;
+	std::vector<Band> selBands;
+	std::vector<double> selWls;
+	for(int i : idx) {
+		sel.push_back(rasterBands[i]);
+		selBands.push_back(bands[i]);
+		selWls.push_back(wavelengths[i]);
+	}
+	m_raster->setBands(sel);
+	bands.swap(selBands);
+	wavelengths.swap(selWls);
+	intensities.resize(bands.size());
+}
+
 
 
 void BandPropsReader::load(const std::string& filename, const std::string& delimiter) {
@@ -544,108 +672,111 @@ void BandPropsReader::configureSpectrum(Spectrum& spec) {
 }
 
 
-void doRun(std::list<std::string>* queue, std::mutex* mtx, std::atomic<int>* count, std::atomic<int>* current,
+void Convolve::doRun(std::list<std::string>* queue, std::mutex* mtx,
 		const std::string* bandDef, const std::string* bandDefDelim, const std::string* spectraDelim,
 		int spectraFirstRow, int spectraFirstCol, int spectraDateCol, int spectraTimeCol,
 		const std::string* output, const std::string* outputDelim, FileType /*outputType*/,
-		double inputScale, double /*tolerance*/, double bandShift, size_t memLimit,
-		bool* running, char* finished) {
-
-	while(*running) {
-		std::this_thread::sleep_for(std::chrono::milliseconds(1));
-		std::string spectra;
-		{
-			std::lock_guard<std::mutex> lk(*mtx);
-			if(queue->empty())
-				break;
-			spectra = queue->front();
-			queue->pop_front();
-		}
-
-		// Load the band properties.
-		BandPropsReader rdr;
-		rdr.load(*bandDef, *bandDefDelim);
-
-		const std::map<int, BandProp>& bands = rdr.bands();
-
-		// Load the input spectrum.
-		Spectrum spec(spectraFirstRow, spectraFirstCol, spectraDateCol, spectraTimeCol);
-		spec.load(spectra, *spectraDelim, memLimit);
-		spec.shift(bandShift);
-		spec.scale(inputScale);
-
-		(*count) += spec.count();
-
-		// Configure the output (convolved) spectrum.
-		Spectrum out;
-		rdr.configureSpectrum(out);
-
-		// Configure the kernels and add to btree.
-		int windowSize = 15;
-		BinTree tree;
-		std::vector<Kernel> kernels;
-		{
-			int i = 0;
-			for(const auto& it : bands)
-				kernels.emplace_back(it.second.wl, it.second.fwhm, windowSize, i++);
-			std::sort(kernels.begin(), kernels.end());
-			tree.init(kernels);
-		}
-
-		std::string ext = extension(spectra);
-		std::string base = basename(spectra);
-		std::string outfile = join(*output, base + "_conv" + ext);
-
-		// Create the writer.
-		FileType ftype = getFileType(outfile);
-		std::unique_ptr<Writer> writer;
-		if(ftype == FileType::CSV) {
-			writer.reset(new CSVWriter(outfile)); // wavelengths, bandNames
-		} else {
-			writer.reset(new GDALWriter(outfile, FileType::ENVI, spec.raster()->cols(), spec.raster()->rows(), rdr.bands().size())); //, wavelengths, bandNames
-			static_cast<GDALWriter*>(writer.get())->setProjection(spec.projection());
-			double trans[6];
-			spec.transform(trans);
-			static_cast<GDALWriter*>(writer.get())->setTransform(trans);
-		}
-
-		// Run the convolution record-by-record.
-		bool header = false;
-		char delim = (*outputDelim)[0];
-
-		while(*running && spec.next()) {
-
-			// Reset the output
-			out.reset();
-			out.date = spec.date;
-			out.time = spec.time;
-
-			// Apply the kernel to each band.
-			for(size_t i = 0; i < spec.wavelengths.size(); ++i) {
-				const Kernel& k = tree.find(spec.wavelengths[i]);
-				out.intensities[k.index()] = k.apply(spec.intensities, spec.wavelengths, i);
-				if(!*running) break;
+		double inputScale, double tolerance, double bandShift, size_t memLimit,
+		bool* running, bool binary) {
+	// Clear the running flag on failure so the other workers stop right away.
+	try {
+		// Load the band properties. The kernels are reused across files with the same input bands.
+		Convolver conv(*bandDef, *bandDefDelim, tolerance);
+		const BandPropsReader& rdr = conv.props();
+		Spectrum& out = conv.out;
+
+		while(*running) {
+			std::string spectra;
+			{
+				std::lock_guard<std::mutex> lk(*mtx);
+				if(queue->empty())
+					break;
+				spectra = queue->front();
+				queue->pop_front();
 			}
 
-			// Write the header if this is the first iteration.
-			if(!header && ftype == FileType::CSV) {
-				out.writeHeader(static_cast<CSVWriter*>(writer.get())->outstr(), rdr.minWl, rdr.maxWl, delim);
-				header = true;
-			}
-
-			// Write the record.
-			if(ftype == FileType::CSV) {
-				out.write(static_cast<CSVWriter*>(writer.get())->outstr(), rdr.minWl, rdr.maxWl, delim);
+			// Load the input spectrum.
+			Spectrum spec(spectraFirstRow, spectraFirstCol, spectraDateCol, spectraTimeCol);
+			spec.load(spectra, *spectraDelim, memLimit);
+			spec.shift(bandShift);
+			spec.scale(inputScale);
+			conv.select(spec);
+
+			m_count += spec.count();
+
+			std::string ext = extension(spectra);
+			std::string base = basename(spectra);
+			bool raster = spec.raster().get() != nullptr;
+			// Spectral logs always go back out as logs; other non-raster inputs only when binary is set.
+			bool asLog = !raster && (binary || ext == ".slog");
+			if(asLog)
+				ext = ".slog";
+			std::string outfile = join(*output, base + "_conv" + ext);
+
+			// Create the writer.
+			std::unique_ptr<Writer> writer;
+			std::unique_ptr<SpectralLogWriter> logWriter;
+			if(raster) {
+				writer.reset(new GDALWriter(outfile, FileType::ENVI, spec.raster()->cols(), spec.raster()->rows(), rdr.bands().size())); //, wavelengths, bandNames
+				static_cast<GDALWriter*>(writer.get())->setProjection(spec.projection());
+				double trans[6];
+				spec.transform(trans);
+				static_cast<GDALWriter*>(writer.get())->setTransform(trans);
+			} else if(asLog) {
+				std::vector<double> wls;
+				for(const Band& b : out.bands) {
+					if(b.wl() >= rdr.minWl && b.wl() <= rdr.maxWl)
+						wls.push_back(b.wl());
+				}
+				std::string units = spec.units();
+				logWriter.reset(new SpectralLogWriter(outfile, wls, units.empty() ? "nm" : units));
 			} else {
-				out.write(static_cast<GDALWriter*>(writer.get()), rdr.minWl, rdr.maxWl, spec.col(), spec.row());
+				writer.reset(new CSVWriter(outfile)); // wavelengths, bandNames
 			}
 
-			// Update progress.
-			(*current)++;
-			if(!*running) break;
+			// Run the convolution record-by-record.
+			bool header = false;
+			char delim = (*outputDelim)[0];
+
+			while(*running && spec.next()) {
+
+				conv.apply(spec);
+
+				// Write the record, and the header if this is the first iteration.
+				if(raster) {
+					out.write(static_cast<GDALWriter*>(writer.get()), rdr.minWl, rdr.maxWl, spec.col(), spec.row());
+				} else if(asLog) {
+					out.write(logWriter.get(), rdr.minWl, rdr.maxWl);
+				} else {
+					if(!header) {
+						out.writeHeader(static_cast<CSVWriter*>(writer.get())->outstr(), rdr.minWl, rdr.maxWl, delim);
+						header = true;
+					}
+					out.write(static_cast<CSVWriter*>(writer.get())->outstr(), rdr.minWl, rdr.maxWl, delim);
+				}
+
+				// Update progress.
+				++m_current;
+				notify(false);
+				if(!*running) break;
+			}
 		}
+	} catch(...) {
+		*running = false;
+		throw;
 	}
-	*finished = 1;
+}
+
+void Convolve::notify(bool force) {
+	long now = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	long last = m_lastUpdate;
+	if(!force && now - last < UPDATE_INTERVAL)
+		return;
+	// Only the thread that wins the exchange sends the update; the others carry on.
+	if(!m_lastUpdate.compare_exchange_strong(last, now) && !force)
+		return;
+	std::lock_guard<std::mutex> lk(m_updateMtx);
+	m_listener->update(this);
 }
 
 void Convolve::run(ConvolveListener& listener,
@@ -654,60 +785,125 @@ void Convolve::run(ConvolveListener& listener,
 		int spectraFirstRow, int spectraFirstCol,
 		int spectraDateCol, int spectraTimeCol,
 		const std::string& output, const std::string& outputDelim, FileType outputType,
-		double inputScale, double tolerance, double bandShift, size_t memLimit, int threads, bool& running) {
+		double inputScale, double tolerance, double bandShift, size_t memLimit, int threads, bool& running,
+		bool binary) {
+
+	m_listener = &listener;
+	m_count = 0;
+	m_current = 0;
+	m_lastUpdate = 0;
 
 	// Notify a listener.
 	listener.started(this);
 
-	std::atomic<int> count(0);
-	std::atomic<int> current(0);
 	std::list<std::string> queue;
 	std::mutex mtx;
 
 	for(const std::string& f : spectra)
 		queue.push_back(f);
 
-	std::vector<std::thread> thr;
-	std::vector<char> finished(threads);
-	std::fill(finished.begin(), finished.end(), 0);
-
+	// Each worker pulls files from the queue until it is empty. The futures
+	// signal completion and carry any exception back to this thread.
+	std::vector<std::future<void>> workers;
 	for(int i = 0; i < threads; ++i) {
-		finished[i] = false;
-		thr.emplace_back(doRun, &queue, &mtx, &count, &current,
+		workers.push_back(std::async(std::launch::async, &Convolve::doRun, this, &queue, &mtx,
 				&bandDef, &bandDefDelim, &spectraDelim,
 				spectraFirstRow, spectraFirstCol, spectraDateCol, spectraTimeCol,
 				&output, &outputDelim, outputType, inputScale,
-				tolerance, bandShift, memLimit, &running, (finished.data() + i));
+				tolerance, bandShift, memLimit, &running, binary));
 	}
 
-	while(running) {
-		std::this_thread::sleep_for(std::chrono::milliseconds(10));
-		int n = 0;
-		for(int i = 0; i < threads; ++i) {
-			if(!finished[i])
-				++n;
+	std::exception_ptr ex;
+	for(std::future<void>& w : workers) {
+		try {
+			w.get();
+		} catch(...) {
+			// Stop the other workers and report the first failure.
+			if(!ex)
+				ex = std::current_exception();
+			running = false;
 		}
-		m_progress = count == 0 ? 0 : ((float) current / count);
-		listener.update(this);
-		if(!n)
-			break;
 	}
-
-	for(int i = 0; i < threads; ++i) {
-		if(thr[i].joinable())
-			thr[i].join();
+	if(ex) {
+		listener.stopped(this);
+		std::rethrow_exception(ex);
 	}
 
+	notify(true);
+
 	// Notify listener of completion.
 	listener.finished(this);
 }
 
+void Convolve::run(ConvolveListener& listener,
+		const std::string& bandDef, const std::string& bandDefDelim,
+		const std::string& spectra, const std::string& spectraDelim,
+		int spectraFirstRow, int spectraFirstCol, int spectraDateCol, int spectraTimeCol,
+		double inputScale, double tolerance, double bandShift,
+		FlameReader& output, bool& running) {
+
+	m_listener = &listener;
+	m_count = 0;
+	m_current = 0;
+	m_lastUpdate = 0;
+
+	listener.started(this);
+
+	Convolver conv(bandDef, bandDefDelim, tolerance);
+	const BandPropsReader& rdr = conv.props();
+
+	Spectrum spec(spectraFirstRow, spectraFirstCol, spectraDateCol, spectraTimeCol);
+	spec.load(spectra, spectraDelim, 0);
+	spec.shift(bandShift);
+	spec.scale(inputScale);
+	conv.select(spec);
+
+	m_count = spec.count();
+
+	// Only the bands within the band definition range are passed on, as with the file output.
+	std::vector<size_t> idx;
+	output.wavelengths.clear();
+	for(size_t i = 0; i < conv.out.bands.size(); ++i) {
+		double wl = conv.out.bands[i].wl();
+		if(wl >= rdr.minWl && wl <= rdr.maxWl) {
+			idx.push_back(i);
+			output.wavelengths.push_back(wl);
+		}
+	}
+
+	std::vector<double> values(idx.size());
+	while(running && spec.next()) {
+		conv.apply(spec);
+		for(size_t i = 0; i < idx.size(); ++i)
+			values[i] = conv.out.intensities[idx[i]];
+		output.add(conv.out.date, conv.out.time, values);
+		++m_current;
+		notify(false);
+	}
+
+	notify(true);
+
+	if(running) {
+		listener.finished(this);
+	} else {
+		listener.stopped(this);
+	}
+}
+
 size_t Convolve::guess(const std::string& spectra, const std::string& spectraDelim) {
 	Spectrum spec;
 	return spec.inputSize(spectra, spectraDelim) * 1.5;
 }
 
+Convolve::Convolve() :
+	m_listener(nullptr),
+	m_count(0),
+	m_current(0),
+	m_lastUpdate(0) {
+}
+
 double Convolve::progress() const {
-	return m_progress;
+	size_t count = m_count;
+	return count == 0 ? 0 : std::min(1.0, (double) m_current / count);
 }
 
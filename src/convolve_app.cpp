@@ -81,7 +81,9 @@ void usage() {
 			<< " -dc 	Date column index (zero-based). (Default -1.)\n"
 			<< " -tc 	Timestamp column index (zero-based). (Default -1.)\n"
 			<< " -ot 	Output file type. 'CSV', 'ENVI' or 'GTiff'. (Default 'CSV'.) \n"
-			<< " -m <m> The memory limit above which file-backed storage is used. (Default 0.)\n"
+			<< " -ob 	Write non-raster output as a binary spectral log (.slog) instead of text.\n"
+			<< "     	Spectral log inputs are always written as logs.\n"
+			<< " -m <m> The memory (bytes) each thread may use to buffer raster tiles. (Default 0; one block at a time.)\n"
 			<< " -p <p> Run using the given number of threads. The -m argument is multiplied by this number. (Default 1.)\n"
 			<< " -g     Print the expected memory consumption given the input file(s).\n"
 			<< "     Run without arguments to use the gui.\n";
@@ -109,6 +111,7 @@ int main(int argc, char** argv) {
 			bool guess = false;
 			size_t memLimit = 0;
 			int threads = 1;
+			bool binary = false;
 
 			for(int i = 1; i < argc; ++i) {
 				std::string arg = argv[i];
@@ -143,6 +146,8 @@ int main(int argc, char** argv) {
 					} else {
 						throw std::runtime_error("Invalid file type: " + type);
 					}
+				} else if(arg == "-ob") {
+					binary = true;
 				} else if(arg == "-m") {
 					memLimit = std::stoull(argv[++i]);
 				} else if(arg == "-p") {
@@ -171,7 +176,7 @@ int main(int argc, char** argv) {
 				std::cout << m << "\n";
 				return 0;
 			} else {
-				conv.run(listener, bandDef, bandDelim, spectra, specDelim, firstRow, firstCol, dateCol, timeCol, output, outputDelim, outputType, inputScale, threshold, shift, memLimit, threads, running);
+				conv.run(listener, bandDef, bandDelim, spectra, specDelim, firstRow, firstCol, dateCol, timeCol, output, outputDelim, outputType, inputScale, threshold, shift, memLimit, threads, running, binary);
 			}
 		}
 	} else {
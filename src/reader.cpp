@@ -6,18 +6,29 @@
  */
 
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <fcntl.h>
+#include <unistd.h>
 #include <sys/resource.h>
 
 #include <iostream>
 #include <fstream>
 #include <sstream>
 #include <ctime>
+#include <cmath>
 #include <chrono>
 #include <list>
 #include <iomanip>
+#include <algorithm>
+#include <charconv>
+#include <cctype>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <future>
 
 #include <gdal_priv.h>
+#include <cpl_conv.h>
 #include <ogrsf_frmts.h>
 
 #include "reader.hpp"
@@ -25,23 +36,327 @@
 #include "util.hpp"
 
 using namespace hlrg::reader;
-using namespace hlrg::ds;
 using namespace geo::util;
 
 namespace {
 
-	long getUTCMilSec(const std::string& input, const std::string& fmt) {
-		// hack: https://stackoverflow.com/questions/14504870/convert-stdchronotime-point-to-unix-timestamp#14505248
-		std::tm t = {};
-		std::stringstream ss(input);
-		ss >> std::get_time(&t, fmt.c_str());
-		time_t t1 = std::mktime(&t);
-		t = *std::gmtime(&t1);
-		time_t t2 = std::mktime(&t);
-		double a = (t1 - (t2 - t1) + std::stod(input.substr(input.find('.'), 6))) * 1000;
-		return a;
+	/**
+	 * Parse a double from the range, ignoring surrounding whitespace. Returns zero
+	 * if the range isn't a number, as atof would.
+	 */
+	double parseDouble(const char* a, const char* b) {
+		while(a < b && std::isspace(*a)) ++a;
+		while(b > a && std::isspace(*(b - 1))) --b;
+		if(a < b && *a == '+') ++a;
+		double v = 0;
+		if(std::from_chars(a, b, v).ec != std::errc())
+			return 0;
+		return v;
 	}
 
+	/**
+	 * Parse a double from the range, ignoring surrounding whitespace. Returns
+	 * false if the range isn't a number.
+	 */
+	bool parseDouble(const char* a, const char* b, double& v) {
+		while(a < b && std::isspace(*a)) ++a;
+		while(b > a && std::isspace(*(b - 1))) --b;
+		if(a < b && *a == '+') ++a;
+		return a < b && std::from_chars(a, b, v).ec == std::errc();
+	}
+
+	/**
+	 * Parse an integer from the range, ignoring surrounding whitespace.
+	 */
+	bool parseLong(const char* a, const char* b, long& v) {
+		while(a < b && std::isspace(*a)) ++a;
+		while(b > a && std::isspace(*(b - 1))) --b;
+		if(a < b && *a == '+') ++a;
+		return a < b && std::from_chars(a, b, v).ec == std::errc();
+	}
+
+	/**
+	 * Return the number of days since the epoch for the given civil date.
+	 * See http://howardhinnant.github.io/date_algorithms.html#days_from_civil
+	 */
+	long daysFromCivil(long y, unsigned m, unsigned d) {
+		y -= m <= 2;
+		long era = (y >= 0 ? y : y - 399) / 400;
+		unsigned yoe = (unsigned) (y - era * 400);
+		unsigned doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+		unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+		return era * 146097 + (long) doe - 719468;
+	}
+
+	/**
+	 * Read n integers separated by single non-digit characters, advancing
+	 * the start of the range past them.
+	 */
+	bool parseFields(const char*& a, const char* b, long* f, int n) {
+		for(int i = 0; i < n; ++i) {
+			if(i > 0) {
+				// Skip the separator.
+				if(a >= b || std::isdigit(*a))
+					return false;
+				++a;
+			}
+			const char* s = a;
+			long v = 0;
+			while(a < b && std::isdigit(*a))
+				v = v * 10 + (*a++ - '0');
+			if(a == s)
+				return false;
+			f[i] = v;
+		}
+		return true;
+	}
+
+	/**
+	 * Parse optional fractional seconds, truncated to milliseconds. The
+	 * fraction must run to the end of the range.
+	 */
+	bool parseMillis(const char* a, const char* b, long& ms) {
+		ms = 0;
+		if(a < b && *a == '.') {
+			++a;
+			for(int i = 0; i < 3; ++i)
+				ms = ms * 10 + (a < b && std::isdigit(*a) ? *a++ - '0' : 0);
+			while(a < b && std::isdigit(*a))
+				++a;
+		}
+		return a == b;
+	}
+
+	/**
+	 * Parse a fixed-order UTC date, year, month, day, hour, minute, second, with
+	 * any single non-digit separators and optional fractional seconds, e.g.
+	 * "2018-05-09 16:42:03.125". Equivalent to getUTCMilSec for those formats,
+	 * without the stream and mktime calls.
+	 *
+	 * \param a The start of the string.
+	 * \param b The end of the string.
+	 * \param ms Updated with the time in milliseconds since the epoch.
+	 * \return True if the date was parsed.
+	 */
+	bool parseDateTime(const char* a, const char* b, long& ms) {
+		while(a < b && std::isspace(*a)) ++a;
+		while(b > a && std::isspace(*(b - 1))) --b;
+		long f[6];
+		long frac;
+		if(!parseFields(a, b, f, 6) || f[1] < 1 || f[1] > 12 || f[2] < 1 || f[2] > 31
+				|| !parseMillis(a, b, frac))
+			return false;
+		ms = ((daysFromCivil(f[0], f[1], f[2]) * 24 + f[3]) * 60 + f[4]) * 60 + f[5];
+		ms = ms * 1000 + frac;
+		return true;
+	}
+
+	/**
+	 * Parses dates in the same formats as parseDateTime, but remembers the epoch
+	 * of the last date seen, so that a run of timestamps from the same day only
+	 * parses the time of day.
+	 */
+	class EpochCache {
+	private:
+		std::string m_date;	///<! The date part of the last timestamp.
+		long m_epoch;		///<! The time of midnight on that date (ms since the epoch).
+	public:
+		EpochCache() :
+			m_epoch(0) {
+		}
+
+		bool parse(const char* a, const char* b, long& ms) {
+			while(a < b && std::isspace(*a)) ++a;
+			while(b > a && std::isspace(*(b - 1))) --b;
+			const char* sp = a;
+			while(sp < b && !std::isspace(*sp))
+				++sp;
+			if(sp == b)
+				return false;
+			size_t len = sp - a;
+			if(m_date.size() != len || m_date.compare(0, len, a, len)) {
+				const char* p = a;
+				long f[3];
+				if(!parseFields(p, sp, f, 3) || p != sp || f[1] < 1 || f[1] > 12 || f[2] < 1 || f[2] > 31)
+					return false;
+				m_date.assign(a, len);
+				m_epoch = daysFromCivil(f[0], f[1], f[2]) * 86400000L;
+			}
+			const char* p = sp + 1;
+			long f[3];
+			long frac;
+			if(!parseFields(p, b, f, 3) || !parseMillis(p, b, frac))
+				return false;
+			ms = m_epoch + ((f[0] * 60 + f[1]) * 60 + f[2]) * 1000 + frac;
+			return true;
+		}
+	};
+
+	/**
+	 * Split the line on commas into a list of [start, end) ranges.
+	 */
+	void splitFields(const std::string& line, std::vector<std::pair<const char*, const char*>>& fields) {
+		fields.clear();
+		const char* p = line.data();
+		const char* end = p + line.size();
+		if(end > p && *(end - 1) == '\r')
+			--end;
+		const char* start = p;
+		for(; p < end; ++p) {
+			if(*p == ',') {
+				fields.emplace_back(start, p);
+				start = p + 1;
+			}
+		}
+		fields.emplace_back(start, end);
+	}
+
+	/**
+	 * Transpose a row-major rows x cols matrix into out, in tiles that fit in cache.
+	 */
+	void blockedTranspose(const double* in, double* out, size_t rows, size_t cols) {
+		constexpr size_t TILE = 32;
+		for(size_t r0 = 0; r0 < rows; r0 += TILE) {
+			size_t r1 = std::min(rows, r0 + TILE);
+			for(size_t c0 = 0; c0 < cols; c0 += TILE) {
+				size_t c1 = std::min(cols, c0 + TILE);
+				for(size_t r = r0; r < r1; ++r) {
+					for(size_t c = c0; c < c1; ++c)
+						out[c * rows + r] = in[r * cols + c];
+				}
+			}
+		}
+	}
+
+} // anon
+
+bool hlrg::reader::parseUTCMilSec(const std::string& input, long& ms) {
+	return parseDateTime(input.data(), input.data() + input.size(), ms);
+}
+
+long hlrg::reader::getUTCMilSec(const std::string& input, const std::string& fmt) {
+	// hack: https://stackoverflow.com/questions/14504870/convert-stdchronotime-point-to-unix-timestamp#14505248
+	std::tm t = {};
+	std::stringstream ss(input);
+	ss >> std::get_time(&t, fmt.c_str());
+	time_t t1 = std::mktime(&t);
+	t = *std::gmtime(&t1);
+	time_t t2 = std::mktime(&t);
+	size_t dot = input.find('.');
+	double frac = dot == std::string::npos ? 0 : std::stod(input.substr(dot, 6));
+	double a = (t1 - (t2 - t1) + frac) * 1000;
+	return a;
+}
+
+hlrg::reader::envi::Header::Header() :
+	samples(0), lines(0), bands(0),
+	headerOffset(0),
+	dataType(0),
+	byteOrder(0) {
+}
+
+GDALDataType hlrg::reader::envi::Header::gdalType() const {
+	switch(dataType) {
+	case 1: return GDT_Byte;
+	case 2: return GDT_Int16;
+	case 3: return GDT_Int32;
+	case 4: return GDT_Float32;
+	case 5: return GDT_Float64;
+	case 12: return GDT_UInt16;
+	case 13: return GDT_UInt32;
+	default: return GDT_Unknown;
+	}
+}
+
+bool hlrg::reader::envi::Header::hostOrder() const {
+	const uint16_t one = 1;
+	int host = *((const char*) &one) == 1 ? 0 : 1;
+	return byteOrder == host;
+}
+
+std::string hlrg::reader::envi::headerFile(const std::string& filename) {
+	if(isfile(filename + ".hdr"))
+		return filename + ".hdr";
+	size_t slash = filename.find_last_of('/');
+	size_t dot = filename.find_last_of('.');
+	if(dot != std::string::npos && (slash == std::string::npos || dot > slash)) {
+		std::string hdr = filename.substr(0, dot) + ".hdr";
+		if(isfile(hdr))
+			return hdr;
+	}
+	return "";
+}
+
+namespace {
+
+	std::string trim(const std::string& str) {
+		size_t a = str.find_first_not_of(" \t\r\n");
+		if(a == std::string::npos)
+			return "";
+		size_t b = str.find_last_not_of(" \t\r\n");
+		return str.substr(a, b - a + 1);
+	}
+
+	std::vector<std::string> splitList(const std::string& str) {
+		std::vector<std::string> items;
+		std::stringstream ss(str);
+		std::string item;
+		while(std::getline(ss, item, ','))
+			items.push_back(trim(item));
+		return items;
+	}
+
+} // anon
+
+bool hlrg::reader::envi::readHeader(const std::string& filename, Header& hdr) {
+	std::ifstream in(filename, std::ios::in);
+	std::string line;
+	if(!std::getline(in, line) || trim(line) != "ENVI")
+		return false;
+	while(std::getline(in, line)) {
+		size_t eq = line.find('=');
+		if(eq == std::string::npos)
+			continue;
+		std::string key = lowercase(trim(line.substr(0, eq)));
+		std::string value = trim(line.substr(eq + 1));
+		// Values in braces may run over several lines.
+		if(!value.empty() && value[0] == '{') {
+			while(value.find('}') == std::string::npos && std::getline(in, line))
+				value += " " + trim(line);
+			size_t end = value.find('}');
+			value = trim(value.substr(1, end == std::string::npos ? std::string::npos : end - 1));
+		}
+		hdr.fields[key] = value;
+	}
+	const auto& f = hdr.fields;
+	try {
+		if(f.count("samples")) hdr.samples = std::stoi(f.at("samples"));
+		if(f.count("lines")) hdr.lines = std::stoi(f.at("lines"));
+		if(f.count("bands")) hdr.bands = std::stoi(f.at("bands"));
+		if(f.count("header offset")) hdr.headerOffset = std::stoull(f.at("header offset"));
+		if(f.count("data type")) hdr.dataType = std::stoi(f.at("data type"));
+		if(f.count("byte order")) hdr.byteOrder = std::stoi(f.at("byte order"));
+		if(f.count("wavelength")) {
+			for(const std::string& wl : splitList(f.at("wavelength")))
+				hdr.wavelengths.push_back(std::stod(wl));
+		}
+	} catch(const std::exception&) {
+		return false;
+	}
+	if(f.count("interleave")) hdr.interleave = lowercase(f.at("interleave"));
+	if(f.count("file type")) hdr.fileType = f.at("file type");
+	if(f.count("wavelength units")) hdr.wavelengthUnits = f.at("wavelength units");
+	if(f.count("band names")) hdr.bandNames = splitList(f.at("band names"));
+	if(f.count("spectra names")) hdr.bandNames = splitList(f.at("spectra names"));
+	return true;
+}
+
+bool hlrg::reader::slog::isSpectralLog(const std::string& filename) {
+	std::ifstream in(filename, std::ios::in|std::ios::binary);
+	char magic[sizeof(MAGIC)];
+	if(!in.read(magic, sizeof(magic)))
+		return false;
+	return std::equal(magic, magic + sizeof(magic), MAGIC);
 }
 
 Reader::Reader() :
@@ -61,12 +376,24 @@ void Reader::setBufSize(int bufSize) {
 }
 
 void Reader::setBandMap(const std::map<int, int>& map) {
-	m_bandMap = map;
+	m_wavelengths.clear();
+	m_wlBands.clear();
+	m_bandWl.clear();
+	for(const auto& p : map) {
+		m_wavelengths.push_back(p.first);
+		m_wlBands.push_back(p.second);
+		if(p.second >= 0) {
+			if(p.second >= (int) m_bandWl.size())
+				m_bandWl.resize(p.second + 1, 0);
+			m_bandWl[p.second] = p.first;
+		}
+	}
+	m_bandList.clear();
 	m_minIdx = 1;
 	m_maxIdx = map.size();
 	if(m_maxIdx > m_minIdx) {
-		m_minWl = std::next(m_bandMap.begin(), m_minIdx - 1)->first;
-		m_maxWl = std::next(m_bandMap.begin(), m_maxIdx - 1)->first;
+		m_minWl = m_wavelengths[m_minIdx - 1];
+		m_maxWl = m_wavelengths[m_maxIdx - 1];
 	} else {
 		m_minIdx = 0;
 		m_minWl = 0;
@@ -74,24 +401,89 @@ void Reader::setBandMap(const std::map<int, int>& map) {
 	}
 }
 
-void Reader::setBandRange(double min, double max) {
-	int mins = (int) (min * WL_SCALE);
-	int maxs = (int) (max * WL_SCALE);
-	for(auto it = m_bandMap.begin(); it != m_bandMap.end(); ++it) {
-		if(it->first <= mins) {
-			m_minWl = it->first;
-			m_minIdx = it->second;
-		}
-		if(it->first >= maxs) {
-			m_maxWl = it->first;
-			m_maxIdx = it->second;
-			break;
+std::vector<int> Reader::bandsInWindows(const std::vector<std::pair<double, double>>& windows) const {
+	std::vector<int> bands;
+	for(const auto& w : windows) {
+		int mins = (int) std::floor(w.first * WL_SCALE);
+		int maxs = (int) std::ceil(w.second * WL_SCALE);
+		size_t i = std::lower_bound(m_wavelengths.begin(), m_wavelengths.end(), mins) - m_wavelengths.begin();
+		for(; i < m_wavelengths.size() && m_wavelengths[i] <= maxs; ++i) {
+			if(m_wlBands[i] >= 0)
+				bands.push_back(m_wlBands[i]);
 		}
 	}
+	return bands;
+}
+
+void Reader::setBandRange(double min, double max) {
+	if(m_wavelengths.empty())
+		return;
+	std::vector<int> bands = bandsInWindows({{min, max}});
+	if(bands.empty())
+		bands.push_back(nearestBand((min + max) / 2));
+	setBands(bands);
+}
+
+void Reader::setBandWindows(const std::vector<std::pair<double, double>>& windows) {
+	std::vector<int> bands = bandsInWindows(windows);
+	if(!bands.empty())
+		setBands(bands);
+}
+
+bool Reader::supportsBandList() const {
+	return false;
+}
+
+void Reader::setBands(const std::vector<int>& bands) {
+	std::vector<int> sel(bands);
+	std::sort(sel.begin(), sel.end());
+	sel.erase(std::unique(sel.begin(), sel.end()), sel.end());
+	if(sel.empty())
+		throw std::invalid_argument("No bands selected.");
+	bool contiguous = sel.back() - sel.front() + 1 == (int) sel.size();
+	if(!contiguous && !supportsBandList())
+		throw std::invalid_argument("This reader can only select a contiguous run of bands.");
+	m_minIdx = sel.front();
+	m_maxIdx = sel.back();
+	m_minWl = m_minIdx >= 0 && m_minIdx < (int) m_bandWl.size() ? m_bandWl[m_minIdx] : 0;
+	m_maxWl = m_maxIdx >= 0 && m_maxIdx < (int) m_bandWl.size() ? m_bandWl[m_maxIdx] : 0;
+	if(contiguous) {
+		m_bandList.clear();
+	} else {
+		m_bandList.swap(sel);
+	}
+}
+
+std::vector<int> Reader::selectedBands() const {
+	if(!m_bandList.empty())
+		return m_bandList;
+	std::vector<int> bands;
+	for(int b = m_minIdx; b <= m_maxIdx; ++b)
+		bands.push_back(b);
+	return bands;
 }
 
 std::map<int, int> Reader::getBandMap() {
-	return m_bandMap;
+	std::map<int, int> map;
+	for(size_t i = 0; i < m_wavelengths.size(); ++i)
+		map.emplace_hint(map.end(), m_wavelengths[i], m_wlBands[i]);
+	return map;
+}
+
+int Reader::nearestBand(double wl) const {
+	if(m_wavelengths.empty())
+		return 0;
+	int iwl = (int) (wl * WL_SCALE);
+	size_t i = std::lower_bound(m_wavelengths.begin(), m_wavelengths.end(), iwl) - m_wavelengths.begin();
+	if(i == m_wavelengths.size() || (i > 0 && iwl - m_wavelengths[i - 1] <= m_wavelengths[i] - iwl))
+		--i;
+	return m_wlBands[i];
+}
+
+double Reader::bandWavelength(int band) const {
+	if(band < 0 || band >= (int) m_bandWl.size())
+		return 0;
+	return (double) m_bandWl[band] / WL_SCALE;
 }
 
 std::vector<double> Reader::getBandRange() const {
@@ -100,23 +492,34 @@ std::vector<double> Reader::getBandRange() const {
 
 std::vector<double> Reader::getWavelengths() const {
 	std::vector<double> bands;
-	if(m_maxIdx > 0 && m_maxIdx > m_minIdx) {
-		for(auto p = std::next(m_bandMap.begin(), m_minIdx - 1); p != std::next(m_bandMap.begin(), m_maxIdx); ++p)
-			bands.push_back((double) p->first / WL_SCALE);
-	} else {
-		for(const auto& p : m_bandMap)
-			bands.push_back((double) p.first / WL_SCALE);
+	if(!m_bandList.empty()) {
+		for(int b : m_bandList)
+			bands.push_back(bandWavelength(b));
+		return bands;
+	}
+	size_t first = 0, last = m_wavelengths.size();
+	if(m_maxIdx > 0 && m_minIdx > 0 && m_maxIdx >= m_minIdx) {
+		last = std::min(last, (size_t) m_maxIdx);
+		first = std::min(last, (size_t) m_minIdx - 1);
 	}
+	bands.reserve(last - first);
+	for(size_t i = first; i < last; ++i)
+		bands.push_back((double) m_wavelengths[i] / WL_SCALE);
 	return bands;
 }
 
 std::vector<std::string> Reader::getBandNames() const {
-	std::vector<std::string> names;
-	if(m_maxIdx > 0 && m_maxIdx > m_minIdx) {
-		for(auto p = std::next(m_bandNames.begin(), m_minIdx - 1); p != std::next(m_bandNames.begin(), m_maxIdx); ++p)
-			names.push_back(*p);
+	if(!m_bandList.empty()) {
+		std::vector<std::string> names;
+		for(int b : m_bandList)
+			names.push_back(b > 0 && b <= (int) m_bandNames.size() ? m_bandNames[b - 1] : "");
 		return names;
 	}
+	if(m_maxIdx > 0 && m_minIdx > 0 && m_maxIdx >= m_minIdx) {
+		size_t last = std::min(m_bandNames.size(), (size_t) m_maxIdx);
+		size_t first = std::min(last, (size_t) m_minIdx - 1);
+		return std::vector<std::string>(m_bandNames.begin() + first, m_bandNames.begin() + last);
+	}
 	return m_bandNames;
 }
 
@@ -133,7 +536,7 @@ int Reader::rows() const {
 }
 
 int Reader::bands() const {
-	return m_maxIdx - m_minIdx + 1;
+	return m_bandList.empty() ? m_maxIdx - m_minIdx + 1 : (int) m_bandList.size();
 }
 
 
@@ -225,6 +628,7 @@ PointSetReader::PointSetReader(const std::string& filename, const std::string& l
 	GDALClose(ds);
 
 	m_tree->build();
+	buildCells();
 }
 
 std::vector<std::string> PointSetReader::getLayerNames(const std::string& filename) {
@@ -265,6 +669,24 @@ std::vector<std::string> PointSetReader::getFieldNames(const std::string& filena
 	return names;
 }
 
+namespace {
+
+	constexpr int MAX_CELL_RADIUS = 4; ///<! The largest radius (in cells) for which sampleNear probes the cell index.
+
+	uint64_t cellKey(int c, int r) {
+		return ((uint64_t) (uint32_t) c << 32) | (uint32_t) r;
+	}
+
+} // anon
+
+void PointSetReader::buildCells() {
+	m_cells.clear();
+	m_cells.reserve(m_tree->items().size());
+	// All points in a cell are the same distance from any other cell, so only the first is kept.
+	for(hlrg::reader::Point* pt : m_tree->items())
+		m_cells.emplace(cellKey(pt->c(), pt->r()), pt);
+}
+
 void PointSetReader::toGridSpace(GDALReader* gr) {
 
 	for(hlrg::reader::Point* pt : m_tree->items()) {
@@ -273,6 +695,7 @@ void PointSetReader::toGridSpace(GDALReader* gr) {
 	}
 
 	m_tree->build();
+	buildCells();
 }
 
 int PointSetReader::search(double x, double y, double radius, std::vector<hlrg::reader::Point*>& pts) {
@@ -283,6 +706,41 @@ int PointSetReader::search(double x, double y, double radius, std::vector<hlrg::
 
 bool PointSetReader::sampleNear(hlrg::reader::Point& pt, double radius) {
 
+	if(radius < 0)
+		return false;
+
+	if(radius <= MAX_CELL_RADIUS) {
+		// Probe the cells within the radius. The query cell is checked first since
+		// it's the common case, then the rest of the window.
+		auto it = m_cells.find(cellKey(pt.c(), pt.r()));
+		if(it != m_cells.end()) {
+			pt = *it->second;
+			return true;
+		}
+		if(m_cells.empty() || radius < 1)
+			return false;
+		int rad = (int) radius;
+		double minD = radius * radius;
+		hlrg::reader::Point* found = nullptr;
+		for(int r = -rad; r <= rad; ++r) {
+			for(int c = -rad; c <= rad; ++c) {
+				double d = c * c + r * r;
+				if(d > minD || (found && d == minD))
+					continue;
+				auto cell = m_cells.find(cellKey(pt.c() + c, pt.r() + r));
+				if(cell != m_cells.end()) {
+					minD = d;
+					found = cell->second;
+				}
+			}
+		}
+		if(found) {
+			pt = *found;
+			return true;
+		}
+		return false;
+	}
+
 	std::vector<double> dist;
 	std::vector<hlrg::reader::Point*> pts;
 	if(m_tree->search(pt, radius, 0, std::back_inserter(pts), std::back_inserter(dist)) > 0) {
@@ -312,13 +770,27 @@ GDALReader::GDALReader(const std::string& filename, size_t memLimit) : Reader(),
 		m_ds(nullptr),
 		m_mappedSize(0),
 		m_memLimit(memLimit),
-		m_mapped(nullptr) {
+		m_mapped(nullptr),
+		m_mappedType(GDT_Unknown),
+		m_mappedTypeSize(0),
+		m_remapType(GDT_Unknown),
+		m_remapCache(false),
+		m_mappedOffset(0),
+		m_mappedView(false),
+		m_mappedStride(0),
+		m_remapCompress(false),
+		m_remapQuantise(false),
+		m_remapCacheTiles(0),
+		m_prefetchRows(4),
+		m_prefetchStop(false),
+		m_prefetchExpect(-1) {
 
 	GDALAllRegister();
 
 	if(!(m_ds = (GDALDataset*) GDALOpen(filename.c_str(), GA_ReadOnly)))
 		throw std::invalid_argument("Failed to open dataset.");
 
+	m_filename = filename;
 	m_minIdx = m_maxIdx = 1;
 	m_bands = m_ds->GetRasterCount();
 	m_cols = m_ds->GetRasterXSize();
@@ -353,136 +825,592 @@ double GDALReader::resY() const {
 	return m_trans[5];
 }
 
-void GDALReader::remap() {
-	remap(1, m_bands);
+bool GDALReader::supportsBandList() const {
+	return true;
 }
 
-void GDALReader::remap(double minWl, double maxWl) {
-	int iminWl = (int) std::floor(minWl * WL_SCALE);
-	int imaxWl = (int) std::ceil(maxWl * WL_SCALE);
-	int a = m_bandMap.lower_bound(iminWl)->second;
-	if(a > 1)
-		a = std::prev(m_bandMap.lower_bound(iminWl))->second;
-	int b = m_bandMap.upper_bound(imaxWl)->second;
-	remap(a, b);
+std::vector<int> GDALReader::readBands() const {
+	std::vector<int> bands;
+	for(int b : selectedBands()) {
+		if(b >= 1 && b <= m_bands)
+			bands.push_back(b);
+	}
+	if(bands.empty()) {
+		for(int b = 1; b <= m_bands; ++b)
+			bands.push_back(b);
+	}
+	return bands;
 }
 
-template <class T>
-void doRemap(GDALDataset* ds, double* mapped, int minBand, int maxBand, int cols, int rows) {
-
-	int mappedBands = maxBand - minBand + 1;
-	int bcols, brows, acols, arows;
+void GDALReader::remap() {
+	remap(readBands());
+}
 
-	GDALRasterBand* firstBand = ds->GetRasterBand(minBand);
-	firstBand->GetBlockSize(&bcols, &brows);
+void GDALReader::remap(double minWl, double maxWl, int threads) {
+	if(m_wavelengths.empty())
+		throw std::runtime_error("The raster has no wavelengths to remap by.");
+	setBandRange(minWl, maxWl);
+	remap(readBands(), threads);
+}
 
-	std::vector<T> buf(mappedBands * bcols * brows * sizeof(T));
-	std::vector<double> row(mappedBands);
+namespace {
 
-	std::cout << "Remapping " << (rows / brows) * (cols / bcols) << " blocks.\n";
-	int lastStat = -1;
-	for(int br = 0; br < rows / brows; ++br) {
-		int stat = (int) ((float) br / (rows / brows)) * 100;
-		if(stat != lastStat) {
+	constexpr int TRANSPOSE_COLS = 16;	///<! The number of pixels in a transpose tile.
+	constexpr int TRANSPOSE_BANDS = 64;	///<! The number of bands in a transpose tile.
+	constexpr size_t COMPRESSED_TILE_SIZE = 1 << 22;	///<! The target uncompressed size of a compressed remap tile.
+
+	/**
+	 * Print a dot for each percent of progress, and the percentage every ten.
+	 *
+	 * \param done The number of units completed.
+	 * \param total The total number of units.
+	 * \param printMtx Guards the progress output.
+	 * \param lastStat The last progress percentage printed; guarded by printMtx.
+	 */
+	void printProgress(size_t done, size_t total, std::mutex* printMtx, int* lastStat) {
+		int stat = (int) ((float) done / total * 100);
+		std::lock_guard<std::mutex> lk(*printMtx);
+		if(stat != *lastStat) {
 			if(stat % 10 == 0)
 				std::cout << " " << stat << "% ";
 			std::cout << ".";
 			std::cout.flush();
-			lastStat = stat;
+			*lastStat = stat;
 		}
-		for(int bc = 0; bc < cols / bcols; ++bc) {
+	}
 
-			// Get a "stack" of blocks representing the band data within a region of pixels.
-			// This is BSQ oriented.
-			for(int i = minBand, b = 0; i <= maxBand; ++i, ++b) {
-				GDALRasterBand* band = ds->GetRasterBand(i);
-				if(CE_None != band->ReadBlock(bc, br, buf.data() + (b * bcols * brows)))
-					continue;
+	/**
+	 * Remap the rows of blocks handed out by the shared counter. Each call opens
+	 * its own dataset handle, so any number can run at once.
+	 *
+	 * \param filename The raster filename.
+	 * \param mapped The output buffer.
+	 * \param srcType The source data type; corresponds to T.
+	 * \param storeType The data type of the output buffer.
+	 * \param bands The bands to map.
+	 * \param cols The number of raster columns.
+	 * \param nextRow The index of the next row of blocks to process; shared.
+	 * \param doneRows The number of rows of blocks completed; shared.
+	 * \param printMtx Guards the progress output.
+	 * \param lastStat The last progress percentage printed; guarded by printMtx.
+	 */
+	template <class T>
+	void doRemapRows(const std::string& filename, char* mapped, GDALDataType srcType, GDALDataType storeType, const std::vector<int>* bands, int cols,
+			std::atomic<int>* nextRow, std::atomic<int>* doneRows, std::mutex* printMtx, int* lastStat) {
+
+		auto closer = [](GDALDataset* d) { GDALClose(d); };
+		std::unique_ptr<GDALDataset, decltype(closer)> own((GDALDataset*) GDALOpen(filename.c_str(), GA_ReadOnly), closer);
+		if(!own)
+			throw std::runtime_error("Failed to open dataset for remap: " + filename);
+		GDALDataset* ds = own.get();
+
+		int mappedBands = (int) bands->size();
+		int bcols, brows, acols, arows;
+		GDALRasterBand* firstBand = ds->GetRasterBand(bands->front());
+		firstBand->GetBlockSize(&bcols, &brows);
+		int nbcols = (cols + bcols - 1) / bcols;
+		int nbrows = (ds->GetRasterYSize() + brows - 1) / brows;
+		size_t blockSize = (size_t) bcols * brows;
+
+		std::vector<T> buf(blockSize * mappedBands);
+
+		// If the storage type differs from the source, transpose into a staging row and convert.
+		int storeSize = GDALGetDataTypeSizeBytes(storeType);
+		bool convert = storeType != srcType;
+		std::vector<T> staging(convert ? (size_t) bcols * mappedBands : 0);
+
+		int br;
+		while((br = (*nextRow)++) < nbrows) {
+			for(int bc = 0; bc < nbcols; ++bc) {
+
+				// Get a "stack" of blocks representing the band data within a region of pixels.
+				// This is BSQ oriented.
+				for(int b = 0; b < mappedBands; ++b) {
+					GDALRasterBand* band = ds->GetRasterBand((*bands)[b]);
+					T* blk = buf.data() + b * blockSize;
+					if(CE_None != band->ReadBlock(bc, br, blk)) {
+						std::fill(blk, blk + blockSize, 0);
+						std::lock_guard<std::mutex> lk(*printMtx);
+						std::cerr << "Warning: failed to read block " << bc << ", " << br << " of band " << (*bands)[b] << " in " << filename << "; using zeros.\n";
+					}
+				}
+
+				// Edge blocks are only partly filled.
+				firstBand->GetActualBlockSize(bc, br, &acols, &arows);
+
+				// Transpose BSQ to BIP in tiles of pixels and bands that fit in cache.
+				for(int r = 0; r < arows; ++r) {
+					char* dst = mapped + ((size_t) (br * brows + r) * cols + (size_t) bc * bcols) * mappedBands * storeSize;
+					T* out = convert ? staging.data() : (T*) dst;
+					for(int c0 = 0; c0 < acols; c0 += TRANSPOSE_COLS) {
+						int c1 = std::min(acols, c0 + TRANSPOSE_COLS);
+						for(int b0 = 0; b0 < mappedBands; b0 += TRANSPOSE_BANDS) {
+							int b1 = std::min(mappedBands, b0 + TRANSPOSE_BANDS);
+							for(int c = c0; c < c1; ++c) {
+								const T* in = buf.data() + (size_t) r * bcols + c;
+								T* px = out + (size_t) c * mappedBands;
+								for(int b = b0; b < b1; ++b)
+									px[b] = in[b * blockSize];
+							}
+						}
+					}
+					if(convert)
+						GDALCopyWords64(out, srcType, sizeof(T), dst, storeType, storeSize, (GIntBig) acols * mappedBands);
+				}
 			}
 
-			firstBand->GetActualBlockSize(bc, br, &acols, &arows);
+			printProgress(++(*doneRows), nbrows, printMtx, lastStat);
+		}
+	}
 
-			for(int r = 0; r < arows; ++r) {
-				for(int c = 0; c < acols; ++c) {
+	template <class T>
+	void doRemap(const std::string& filename, GDALDataset* ds, char* mapped, GDALDataType srcType, GDALDataType storeType, const std::vector<int>& bands, int cols, int rows, int threads) {
 
-					// Copy the band values into the row buffer.
-					for(int b = 0; b < mappedBands; ++b)
-						row[b] = (double) buf[(b * bcols * brows) + r * bcols + c];
+		int bcols, brows;
+		ds->GetRasterBand(bands.front())->GetBlockSize(&bcols, &brows);
+		int nbcols = (cols + bcols - 1) / bcols;
+		int nbrows = (rows + brows - 1) / brows;
 
-					// Write the row into the mapped file as a sequence of band values for the pixel.
-					size_t idx = (size_t) (br * brows + r) * cols * mappedBands + (bc * bcols + c) * mappedBands;
-					std::memcpy(mapped + idx, row.data(), row.size() * sizeof(double));
-				}
+		if(threads <= 0)
+			threads = std::max(1u, std::thread::hardware_concurrency());
+		threads = std::min(threads, nbrows);
+
+		std::cout << "Remapping " << nbrows * nbcols << " blocks on " << threads << " threads.\n";
+
+		std::atomic<int> nextRow(0);
+		std::atomic<int> doneRows(0);
+		std::mutex printMtx;
+		int lastStat = -1;
+
+		std::vector<std::future<void>> workers;
+		for(int i = 0; i < threads; ++i) {
+			workers.push_back(std::async(std::launch::async, &doRemapRows<T>, std::cref(filename), mapped, srcType, storeType, &bands, cols,
+					&nextRow, &doneRows, &printMtx, &lastStat));
+		}
+
+		std::exception_ptr ex;
+		for(std::future<void>& w : workers) {
+			try {
+				w.get();
+			} catch(...) {
+				// Stop the other workers and report the first failure.
+				if(!ex)
+					ex = std::current_exception();
+				nextRow = nbrows;
 			}
 		}
+		if(ex)
+			std::rethrow_exception(ex);
+
+		std::cout << "\n";
+	}
+
+	/**
+	 * Read, encode and store the tiles handed out by the shared counter. Each call opens
+	 * its own dataset handle, so any number can run at once.
+	 *
+	 * \param filename The raster filename.
+	 * \param cube The compressed store.
+	 * \param storeType The data type of the stored values.
+	 * \param bands The bands to map.
+	 * \param cols The number of raster columns.
+	 * \param nextTile The index of the next tile to process; shared.
+	 * \param doneTiles The number of tiles completed; shared.
+	 * \param printMtx Guards the progress output.
+	 * \param lastStat The last progress percentage printed; guarded by printMtx.
+	 */
+	void doCompressTiles(const std::string& filename, CompressedCube* cube, GDALDataType storeType, const std::vector<int>* bands, int cols,
+			std::atomic<size_t>* nextTile, std::atomic<size_t>* doneTiles, std::mutex* printMtx, int* lastStat) {
+
+		GDALDataset* ds = (GDALDataset*) GDALOpen(filename.c_str(), GA_ReadOnly);
+		if(!ds)
+			throw std::runtime_error("Failed to open dataset for remap: " + filename);
+
+		std::vector<int> bandList(*bands);
+		int nbands = (int) bandList.size();
+		int typeSize = GDALGetDataTypeSizeBytes(storeType);
+		size_t tiles = cube->tiles();
+		std::vector<char> data;
+		std::vector<char> buf;
+
+		try {
+			size_t tile;
+			while((tile = (*nextTile)++) < tiles) {
+				int row = (int) tile * cube->tileRows();
+				int rows = cube->tileRows(tile);
+				data.resize((size_t) rows * cols * nbands * typeSize);
+				// GDAL does the interleaving and the type conversion.
+				if(CE_None != ds->RasterIO(GF_Read, 0, row, cols, rows, data.data(), cols, rows, storeType, nbands, bandList.data(),
+						(GSpacing) nbands * typeSize, (GSpacing) cols * nbands * typeSize, typeSize))
+					std::fill(data.begin(), data.end(), 0);
+				cube->put(tile, data, buf);
+				printProgress(++(*doneTiles), tiles, printMtx, lastStat);
+			}
+		} catch(...) {
+			GDALClose(ds);
+			throw;
+		}
+
+		GDALClose(ds);
+	}
+
+} // anon
+
+void GDALReader::setRemapCompression(bool enabled, bool quantise, size_t cacheTiles) {
+	m_remapCompress = enabled;
+	m_remapQuantise = quantise;
+	m_remapCacheTiles = cacheTiles;
+}
+
+void GDALReader::remapCompressed(const std::vector<int>& bands, int threads) {
+	size_t rowSize = (size_t) m_cols * m_mappedBands * m_mappedTypeSize;
+	int tileRows = (int) std::max((size_t) 1, std::min((size_t) m_rows, COMPRESSED_TILE_SIZE / rowSize));
+	m_cube.reset(new CompressedCube(m_cols, m_rows, m_mappedBands, m_mappedType, tileRows, m_remapQuantise, m_remapCacheTiles));
+
+	size_t tiles = m_cube->tiles();
+	if(threads <= 0)
+		threads = std::max(1u, std::thread::hardware_concurrency());
+	threads = (int) std::min((size_t) threads, tiles);
+
+	std::cout << "Compressing " << tiles << " tiles on " << threads << " threads.\n";
+
+	std::atomic<size_t> nextTile(0);
+	std::atomic<size_t> doneTiles(0);
+	std::mutex printMtx;
+	int lastStat = -1;
+
+	std::vector<std::future<void>> workers;
+	for(int i = 0; i < threads; ++i) {
+		workers.push_back(std::async(std::launch::async, &doCompressTiles, std::cref(m_filename), m_cube.get(), m_mappedType, &bands, m_cols,
+				&nextTile, &doneTiles, &printMtx, &lastStat));
+	}
+
+	std::exception_ptr ex;
+	for(std::future<void>& w : workers) {
+		try {
+			w.get();
+		} catch(...) {
+			// Stop the other workers and report the first failure.
+			if(!ex)
+				ex = std::current_exception();
+			nextTile = tiles;
+		}
+	}
+	if(ex) {
+		m_cube.reset();
+		std::rethrow_exception(ex);
+	}
+
+	std::cout << "\nStored " << m_mappedSize << " bytes in " << m_cube->storedSize() << ".\n";
+}
+
+void GDALReader::setRemapType(GDALDataType type) {
+	m_remapType = type;
+}
+
+void GDALReader::setRemapCache(bool enabled, const std::string& dir) {
+	m_remapCache = enabled;
+	m_remapCacheDir = dir;
+}
+
+namespace {
+
+	constexpr char REMAP_CACHE_MAGIC[8] = {'H', 'L', 'R', 'G', 'B', 'I', 'P', '1'};
+	constexpr size_t REMAP_CACHE_DATA_OFFSET = 4096;	///<! Values start on a page boundary after the header.
+
+} // anon
+
+std::string GDALReader::remapCachePath(const std::vector<int>& bands, GDALDataType type, std::string& key) const {
+	struct stat st;
+	if(stat(m_filename.c_str(), &st))
+		throw std::runtime_error("Failed to stat " + m_filename + ": " + strerror(errno));
+	char* real = realpath(m_filename.c_str(), nullptr);
+	std::string path = real ? real : m_filename;
+	free(real);
+	std::stringstream ss;
+	ss << path << "|" << st.st_mtim.tv_sec << "." << st.st_mtim.tv_nsec << "|" << st.st_size << "|";
+	if(bands.back() - bands.front() + 1 == (int) bands.size()) {
+		ss << bands.front() << "-" << bands.back();
+	} else {
+		for(size_t i = 0; i < bands.size(); ++i)
+			ss << (i ? "," : "") << bands[i];
+	}
+	ss << "|" << GDALGetDataTypeName(type);
+	key = ss.str();
+	std::stringstream name;
+	name << basename(m_filename) << "_" << std::hex << std::hash<std::string>{}(key) << ".bip";
+	std::string dir = m_remapCacheDir;
+	if(dir.empty()) {
+		size_t pos = path.find_last_of('/');
+		dir = pos == std::string::npos ? "." : path.substr(0, pos);
+	}
+	return join(dir, name.str());
+}
+
+bool GDALReader::loadRemapCache(const std::string& path, const std::string& key) {
+	int fd = open(path.c_str(), O_RDONLY);
+	if(fd < 0)
+		return false;
+	struct stat st;
+	size_t expected = REMAP_CACHE_DATA_OFFSET + m_mappedSize;
+	if(fstat(fd, &st) || (size_t) st.st_size != expected) {
+		::close(fd);
+		return false;
+	}
+	void* mapped = mmap(0, expected, PROT_READ, MAP_SHARED, fd, 0);
+	::close(fd);
+	if(mapped == MAP_FAILED)
+		return false;
+	// The header holds the magic, the key length and the key.
+	const char* hdr = (const char*) mapped;
+	uint32_t len;
+	std::memcpy(&len, hdr + sizeof(REMAP_CACHE_MAGIC), sizeof(len));
+	if(!std::equal(REMAP_CACHE_MAGIC, REMAP_CACHE_MAGIC + sizeof(REMAP_CACHE_MAGIC), hdr)
+			|| len != key.size() || sizeof(REMAP_CACHE_MAGIC) + sizeof(len) + len > REMAP_CACHE_DATA_OFFSET
+			|| key.compare(0, len, hdr + sizeof(REMAP_CACHE_MAGIC) + sizeof(len), len)) {
+		munmap(mapped, expected);
+		return false;
+	}
+	m_mapped = (char*) mapped + REMAP_CACHE_DATA_OFFSET;
+	m_mappedOffset = REMAP_CACHE_DATA_OFFSET;
+	m_mappedView = true;
+	return true;
+}
+
+bool GDALReader::mapENVI(int minBand) {
+	if(getFileType(m_filename) != FileType::ENVI)
+		return false;
+	envi::Header hdr;
+	std::string hdrFile = envi::headerFile(m_filename);
+	if(hdrFile.empty() || !envi::readHeader(hdrFile, hdr))
+		return false;
+	GDALDataType type = hdr.gdalType();
+	if(hdr.interleave != "bip" || !hdr.hostOrder() || type != m_mappedType
+			|| hdr.samples != m_cols || hdr.lines != m_rows || hdr.bands != m_bands
+			|| (hdr.fields.count("file compression") && hdr.fields.at("file compression") != "0"))
+		return false;
+
+	int fd = open(m_filename.c_str(), O_RDONLY);
+	if(fd < 0)
+		return false;
+	struct stat st;
+	int typeSize = GDALGetDataTypeSizeBytes(type);
+	size_t dataSize = (size_t) m_cols * m_rows * m_bands * typeSize;
+	if(fstat(fd, &st) || (size_t) st.st_size < hdr.headerOffset + dataSize) {
+		::close(fd);
+		return false;
+	}
+	void* mapped = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	::close(fd);
+	if(mapped == MAP_FAILED)
+		return false;
+	madvise(mapped, st.st_size, MADV_SEQUENTIAL);
+
+	// Point at the first mapped band of the first pixel; pixels are a whole spectrum apart.
+	m_mappedOffset = hdr.headerOffset + (size_t) (minBand - 1) * typeSize;
+	m_mapped = (char*) mapped + m_mappedOffset;
+	m_mappedSize = st.st_size - m_mappedOffset;
+	m_mappedStride = m_bands;
+	m_mappedView = true;
+	return true;
+}
+
+void GDALReader::unmap() {
+	m_cube.reset();
+	if(!m_mapped)
+		return;
+	if(m_mappedView) {
+		munmap(m_mapped - m_mappedOffset, m_mappedSize + m_mappedOffset);
+	} else if(m_mappedSize > m_memLimit) {
+		munmap(m_mapped, m_mappedSize);
+	} else {
+		free(m_mapped);
 	}
+	m_mappedFile.reset();
+	m_mapped = nullptr;
+	m_mappedOffset = 0;
+	m_mappedView = false;
+}
 
+void GDALReader::remap(int minBand, int maxBand, int threads) {
+	std::vector<int> bands;
+	for(int b = minBand; b <= maxBand; ++b)
+		bands.push_back(b);
+	remap(bands, threads);
 }
 
-void GDALReader::remap(int minBand, int maxBand) {
+void GDALReader::remap(const std::vector<int>& bands, int threads) {
+	unmap();
+
+	if(bands.empty() || bands.front() < 1 || bands.back() > m_bands || !std::is_sorted(bands.begin(), bands.end()))
+		throw std::invalid_argument("The bands to remap must be valid and in ascending order.");
+
+	int minBand = bands.front();
+	bool contiguous = bands.back() - minBand + 1 == (int) bands.size();
+	GDALRasterBand* firstBand = m_ds->GetRasterBand(minBand);
+	GDALDataType type = firstBand->GetRasterDataType();
+
 	m_mappedMinBand = minBand;
-	m_mappedBands = (maxBand - minBand) + 1;
-	m_mappedSize = (size_t) m_cols * m_rows * m_mappedBands * sizeof(double);
-	if(m_mappedSize > m_memLimit) {
+	m_mappedBandList = contiguous ? std::vector<int>() : bands;
+	m_mappedBands = (int) bands.size();
+	m_mappedType = m_remapType == GDT_Unknown ? type : m_remapType;
+	m_mappedTypeSize = GDALGetDataTypeSizeBytes(m_mappedType);
+	m_mappedSize = (size_t) m_cols * m_rows * m_mappedBands * m_mappedTypeSize;
+	m_mappedStride = m_mappedBands;
+
+	if(contiguous && mapENVI(minBand)) {
+		std::cout << "Using BIP source directly.\n";
+		return;
+	}
+
+	std::string cacheKey, cachePath, cacheTmp;
+	bool cache = m_remapCache;
+	if(cache) {
+		cachePath = remapCachePath(bands, m_mappedType, cacheKey);
+		if(loadRemapCache(cachePath, cacheKey)) {
+			std::cout << "Using remap cache " << cachePath << ".\n";
+			return;
+		}
+		// The key must fit in the header or the cache could never be loaded.
+		if(sizeof(REMAP_CACHE_MAGIC) + sizeof(uint32_t) + cacheKey.size() > REMAP_CACHE_DATA_OFFSET) {
+			std::cerr << "Warning: the remap cache key for " << m_filename << " is too long; not caching.\n";
+			cache = false;
+		}
+	}
+	if(cache) {
+		// Build into a temporary file and rename it into place when done, so that
+		// concurrent processes never see a partial cache.
+		std::cout << "Creating remap cache " << cachePath << ".\n";
+		cacheTmp = cachePath + ".tmp" + std::to_string(getpid());
+		int fd = open(cacheTmp.c_str(), O_RDWR|O_CREAT|O_TRUNC, 0644);
+		if(fd < 0)
+			throw std::runtime_error("Failed to create remap cache " + cacheTmp + ": " + strerror(errno));
+		size_t size = REMAP_CACHE_DATA_OFFSET + m_mappedSize;
+		if(ftruncate(fd, size)) {
+			::close(fd);
+			throw std::runtime_error("Failed to size remap cache " + cacheTmp + ": " + strerror(errno));
+		}
+		char* mapped = (char*) mmap(0, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+		::close(fd);
+		if(mapped == MAP_FAILED)
+			throw std::runtime_error(std::string("Failed to remap: ") + strerror(errno) + " " + std::to_string(errno));
+		uint32_t len = cacheKey.size();
+		std::memcpy(mapped, REMAP_CACHE_MAGIC, sizeof(REMAP_CACHE_MAGIC));
+		std::memcpy(mapped + sizeof(REMAP_CACHE_MAGIC), &len, sizeof(len));
+		std::memcpy(mapped + sizeof(REMAP_CACHE_MAGIC) + sizeof(len), cacheKey.data(), len);
+		m_mapped = mapped + REMAP_CACHE_DATA_OFFSET;
+		m_mappedOffset = REMAP_CACHE_DATA_OFFSET;
+		m_mappedView = true;
+	} else if(m_mappedSize > m_memLimit && m_remapCompress) {
+		std::cout << "Using compressed tiles.\n";
+		remapCompressed(bands, threads);
+		return;
+	} else if(m_mappedSize > m_memLimit) {
 		std::cout << "Using mmap.\n";
 		m_mappedFile.reset(new TmpFile(m_mappedSize));
-		m_mapped = (double*) mmap(0, m_mappedSize, PROT_READ|PROT_WRITE, MAP_SHARED, m_mappedFile->fd, 0);
+		m_mapped = (char*) mmap(0, m_mappedSize, PROT_READ|PROT_WRITE, MAP_SHARED, m_mappedFile->fd, 0);
 		m_mappedFile->close();
 	} else {
 		std::cout << "Using malloc.\n";
-		m_mapped = (double*) malloc(m_mappedSize);
+		m_mapped = (char*) malloc(m_mappedSize);
 	}
 
 	if((long) m_mapped == -1)
 		throw std::runtime_error(std::string("Failed to remap: ") + strerror(errno) + " " + std::to_string(errno));
 
-	GDALRasterBand* firstBand = m_ds->GetRasterBand(minBand);
-	GDALDataType type = firstBand->GetRasterDataType();
+	try {
+		switch(type) {
+		case GDT_Float32:
+			doRemap<float>(m_filename, m_ds, m_mapped, type, m_mappedType, bands, cols(), rows(), threads);
+			break;
+		case GDT_Float64:
+			doRemap<double>(m_filename, m_ds, m_mapped, type, m_mappedType, bands, cols(), rows(), threads);
+			break;
+		case GDT_UInt32:
+			doRemap<uint32_t>(m_filename, m_ds, m_mapped, type, m_mappedType, bands, cols(), rows(), threads);
+			break;
+		case GDT_Int32:
+			doRemap<int32_t>(m_filename, m_ds, m_mapped, type, m_mappedType, bands, cols(), rows(), threads);
+			break;
+		case GDT_UInt16:
+			doRemap<uint16_t>(m_filename, m_ds, m_mapped, type, m_mappedType, bands, cols(), rows(), threads);
+			break;
+		case GDT_Int16:
+			doRemap<int16_t>(m_filename, m_ds, m_mapped, type, m_mappedType, bands, cols(), rows(), threads);
+			break;
+		default:
+			throw std::runtime_error("remap only implemented for some types.");
+		}
+	} catch(...) {
+		if(!cacheTmp.empty())
+			unlink(cacheTmp.c_str());
+		throw;
+	}
 
-	switch(type) {
-	case GDT_Float32:
-		doRemap<float>(m_ds, m_mapped, minBand, maxBand, cols(), rows());
-		break;
-	case GDT_Float64:
-		doRemap<double>(m_ds, m_mapped, minBand, maxBand, cols(), rows());
-		break;
-	case GDT_UInt32:
-		doRemap<uint32_t>(m_ds, m_mapped, minBand, maxBand, cols(), rows());
-		break;
-	case GDT_Int32:
-		doRemap<int32_t>(m_ds, m_mapped, minBand, maxBand, cols(), rows());
-		break;
-	case GDT_UInt16:
-		doRemap<uint16_t>(m_ds, m_mapped, minBand, maxBand, cols(), rows());
-		break;
-	case GDT_Int16:
-		doRemap<int16_t>(m_ds, m_mapped, minBand, maxBand, cols(), rows());
-		break;
-	default:
-		throw std::runtime_error("remap only implemented for some types.");
+	if(!cacheTmp.empty()) {
+		msync(m_mapped - m_mappedOffset, m_mappedSize + m_mappedOffset, MS_SYNC);
+		if(rename(cacheTmp.c_str(), cachePath.c_str())) {
+			std::cerr << "Warning: failed to store remap cache " << cachePath << ": " << strerror(errno) << "\n";
+			unlink(cacheTmp.c_str());
+		}
 	}
 }
 
 double GDALReader::mapped(int col, int row, double wl) {
-	return mapped(col, row, m_bandMap[(int) (wl * WL_SCALE)]);
+	return mapped(col, row, nearestBand(wl));
+}
+
+const char* GDALReader::mappedPixel(int col, int row) {
+	if(m_cube)
+		return col < 0 || row < 0 || col >= m_cols || row >= m_rows ? nullptr : m_cube->pixel(col, row);
+	size_t idx = ((size_t) row * m_cols + col) * m_mappedStride;
+	if(!m_mapped || (idx + m_mappedBands) * m_mappedTypeSize > m_mappedSize)
+		return nullptr;
+	return m_mapped + idx * m_mappedTypeSize;
 }
 
 double GDALReader::mapped(int col, int row, int band) {
-	size_t idx = row * m_cols * m_mappedBands + col * m_mappedBands + (band - m_mappedMinBand);
-	if(idx >= m_mappedSize)
+	int b = band - (int) m_mappedMinBand;
+	if(!m_mappedBandList.empty()) {
+		auto it = std::lower_bound(m_mappedBandList.begin(), m_mappedBandList.end(), band);
+		b = it != m_mappedBandList.end() && *it == band ? (int) (it - m_mappedBandList.begin()) : -1;
+	}
+	const char* px = mappedPixel(col, row);
+	if(!px || b < 0 || b >= m_mappedBands)
 		return std::nan("");
-	return m_mapped[idx];
+	double v;
+	GDALCopyWords(px + (size_t) b * m_mappedTypeSize, m_mappedType, 0, &v, GDT_Float64, 0, 1);
+	return v;
 }
 
 bool GDALReader::mapped(int col, int row, std::vector<double>& values) {
-	size_t idx = (size_t) row * m_cols * m_mappedBands + (size_t) col * m_mappedBands;
-	if(idx + m_mappedBands > m_mappedSize)
+	const char* px = mappedPixel(col, row);
+	if(!px)
 		return false;
 	values.resize(m_mappedBands);
-	std::memcpy(values.data(), m_mapped + idx, m_mappedBands * sizeof(double));
+	GDALCopyWords(px, m_mappedType, m_mappedTypeSize, values.data(), GDT_Float64, sizeof(double), m_mappedBands);
 	return true;
 }
 
+bool GDALReader::readBIP(int col, int row, int cols, int rows, int minBand, int maxBand, std::vector<double>& buf) {
+	std::vector<int> bandList;
+	for(int b = minBand; b <= maxBand; ++b)
+		bandList.push_back(b);
+	return readBIP(col, row, cols, rows, bandList, buf);
+}
+
+bool GDALReader::readBIP(int col, int row, int cols, int rows, const std::vector<int>& bands, std::vector<double>& buf) {
+	if(col < 0 || row < 0 || cols <= 0 || rows <= 0 || col + cols > m_cols || row + rows > m_rows || bands.empty())
+		return false;
+	int nbands = (int) bands.size();
+	buf.resize((size_t) cols * rows * nbands);
+	return CE_None == m_ds->RasterIO(GF_Read, col, row, cols, rows, buf.data(), cols, rows, GDT_Float64,
+			nbands, const_cast<int*>(bands.data()), nbands * sizeof(double), (GSpacing) cols * nbands * sizeof(double), sizeof(double));
+}
+
+void GDALReader::blockSize(int& cols, int& rows) const {
+	m_ds->GetRasterBand(1)->GetBlockSize(&cols, &rows);
+}
 
 void GDALReader::loadBandMap() {
 	std::map<int, int> bandMap;
@@ -518,15 +1446,11 @@ void GDALReader::loadBandMap() {
 }
 
 int GDALReader::toCol(double x) {
-	double trans[6];
-	m_ds->GetGeoTransform(trans);
-	return (int) (x - trans[0]) / trans[1];
+	return (int) std::floor((x - m_trans[0]) / m_trans[1]);
 }
 
 int GDALReader::toRow(double y) {
-	double trans[6];
-	m_ds->GetGeoTransform(trans);
-	return (int) (y - trans[3]) / trans[5];
+	return (int) std::floor((y - m_trans[3]) / m_trans[5]);
 }
 
 int GDALReader::getInt(double x, double y) {
@@ -538,30 +1462,591 @@ int GDALReader::getInt(int col, int row) {
 }
 
 float GDALReader::getFloat(double x, double y) {
-	return GDALReader::getInt(toCol(x), toRow(y));
+	return GDALReader::getFloat(toCol(x), toRow(y));
 }
 
 float GDALReader::getFloat(int col, int row) {
-	if(col < 0 || col >= m_ds->GetRasterXSize() || row < 0 || row >= m_ds->GetRasterYSize())
+	if(col < 0 || col >= m_cols || row < 0 || row >= m_rows)
 		return 0;
-	float buf[1];
-	GDALRasterBand* band = m_ds->GetRasterBand(1);
-	if(CE_None != band->RasterIO(GF_Read, col, row, 1, 1, buf, 1, 1, GDT_Float32, 0, 0, 0))
+	int bcols, brows;
+	blockSize(bcols, brows);
+	const float* block = m_blockCache.get(m_ds, 1, col / bcols, row / brows);
+	if(!block)
 		return 0;
-	return buf[0];
+	return block[(row % brows) * bcols + col % bcols];
 }
 
-bool GDALReader::next(std::string& id, std::vector<double>& buf, int& cols, int& col, int& row) {
+void GDALReader::setBlockCacheSize(int blocks) {
+	m_blockCache.setCapacity(std::max(1, blocks));
+}
 
-	id = "";
-	cols = m_cols;
-	col = m_col;
-	row = m_row;
+namespace {
 
-	if(m_row >= m_rows)
-		return false;
+	constexpr size_t MAX_MASK_TILE = 1 << 22; ///<! The largest number of pixels in a mask tile.
+
+	/**
+	 * Worker for RasterMask. Takes tiles from the shared counter, reads them and packs
+	 * the pixels greater than zero into the tile's bitmap.
+	 *
+	 * \param filename The raster filename.
+	 * \param band The band to read.
+	 * \param cols The number of columns in the raster.
+	 * \param rows The number of rows in the raster.
+	 * \param tileCols The number of columns in a tile.
+	 * \param tileRows The number of rows in a tile.
+	 * \param tilesX The number of tiles across.
+	 * \param tileWords The number of words in a tile's bitmap.
+	 * \param bits The tile bitmaps.
+	 * \param counts The tile counts.
+	 * \param nextTile The counter of the next tile to read.
+	 */
+	void readMaskTiles(const std::string& filename, int band, int cols, int rows, int tileCols, int tileRows, int tilesX,
+			size_t tileWords, uint64_t* bits, uint32_t* counts, std::atomic<size_t>* nextTile) {
+
+		GDALDataset* ds = (GDALDataset*) GDALOpen(filename.c_str(), GA_ReadOnly);
+		if(!ds)
+			throw std::runtime_error("Failed to open mask " + filename);
+		GDALRasterBand* rb = ds->GetRasterBand(band);
+
+		size_t tiles = (size_t) tilesX * ((rows + tileRows - 1) / tileRows);
+		std::vector<double> buf((size_t) tileCols * tileRows);
+		size_t t;
+		while((t = (*nextTile)++) < tiles) {
+			int col = (int) (t % tilesX) * tileCols;
+			int row = (int) (t / tilesX) * tileRows;
+			int tcols = std::min(tileCols, cols - col);
+			int trows = std::min(tileRows, rows - row);
+			if(CE_None != rb->RasterIO(GF_Read, col, row, tcols, trows, buf.data(), tcols, trows, GDT_Float64,
+					sizeof(double), (GSpacing) tileCols * sizeof(double), 0)) {
+				GDALClose(ds);
+				throw std::runtime_error("Failed to read mask " + filename);
+			}
+			uint64_t* words = bits + t * tileWords;
+			for(int r = 0; r < trows; ++r) {
+				const double* px = buf.data() + (size_t) r * tileCols;
+				size_t bit = (size_t) r * tileCols;
+				for(int c = 0; c < tcols; ++c, ++bit) {
+					if(px[c] > 0)
+						words[bit / 64] |= (uint64_t) 1 << (bit % 64);
+				}
+			}
+			uint32_t n = 0;
+			for(size_t i = 0; i < tileWords; ++i)
+				n += __builtin_popcountll(words[i]);
+			counts[t] = n;
+		}
 
-	if(m_mapped) {
+		GDALClose(ds);
+	}
+
+} // anon
+
+RasterMask::RasterMask(const std::string& filename, int band, int threads) :
+	m_cols(0), m_rows(0),
+	m_tileCols(0), m_tileRows(0),
+	m_tilesX(0),
+	m_tileWords(0),
+	m_count(0) {
+
+	GDALAllRegister();
+
+	GDALDataset* ds = (GDALDataset*) GDALOpen(filename.c_str(), GA_ReadOnly);
+	if(!ds)
+		throw std::runtime_error("Failed to open mask " + filename);
+	if(band < 1 || band > ds->GetRasterCount()) {
+		GDALClose(ds);
+		throw std::runtime_error("Invalid band for mask " + filename);
+	}
+	m_cols = ds->GetRasterXSize();
+	m_rows = ds->GetRasterYSize();
+	ds->GetRasterBand(band)->GetBlockSize(&m_tileCols, &m_tileRows);
+	GDALClose(ds);
+
+	// Very large blocks (e.g. whole-image strips) are split into bands of rows.
+	m_tileCols = std::max(1, std::min(m_tileCols, m_cols));
+	m_tileRows = std::max(1, std::min(m_tileRows, m_rows));
+	if((size_t) m_tileCols * m_tileRows > MAX_MASK_TILE)
+		m_tileRows = (int) std::max((size_t) 1, MAX_MASK_TILE / m_tileCols);
+
+	m_tilesX = (m_cols + m_tileCols - 1) / m_tileCols;
+	size_t tiles = (size_t) m_tilesX * ((m_rows + m_tileRows - 1) / m_tileRows);
+	m_tileWords = ((size_t) m_tileCols * m_tileRows + 63) / 64;
+	m_bits.assign(tiles * m_tileWords, 0);
+	m_counts.assign(tiles, 0);
+
+	if(threads <= 0)
+		threads = std::max(1u, std::thread::hardware_concurrency());
+	threads = (int) std::max((size_t) 1, std::min((size_t) threads, tiles));
+
+	std::atomic<size_t> nextTile(0);
+	std::vector<std::future<void>> workers;
+	for(int i = 0; i < threads; ++i) {
+		workers.push_back(std::async(std::launch::async, &readMaskTiles, std::cref(filename), band, m_cols, m_rows,
+				m_tileCols, m_tileRows, m_tilesX, m_tileWords, m_bits.data(), m_counts.data(), &nextTile));
+	}
+	std::exception_ptr ex;
+	for(std::future<void>& w : workers) {
+		try {
+			w.get();
+		} catch(...) {
+			// Stop the other workers and report the first failure.
+			if(!ex)
+				ex = std::current_exception();
+			nextTile = tiles;
+		}
+	}
+	if(ex)
+		std::rethrow_exception(ex);
+
+	for(uint32_t n : m_counts)
+		m_count += n;
+}
+
+int RasterMask::cols() const {
+	return m_cols;
+}
+
+int RasterMask::rows() const {
+	return m_rows;
+}
+
+size_t RasterMask::count() const {
+	return m_count;
+}
+
+BlockCache::BlockCache(size_t capacity) :
+	m_capacity(capacity) {
+}
+
+void BlockCache::setCapacity(size_t capacity) {
+	m_capacity = capacity;
+	while(m_entries.size() > m_capacity) {
+		m_index.erase(m_entries.back().first);
+		m_entries.pop_back();
+	}
+}
+
+const float* BlockCache::get(GDALDataset* ds, int band, int bcol, int brow) {
+	uint64_t key = ((uint64_t) band << 48) | ((uint64_t) brow << 24) | (uint64_t) bcol;
+	auto it = m_index.find(key);
+	if(it != m_index.end()) {
+		m_entries.splice(m_entries.begin(), m_entries, it->second);
+		return m_entries.front().second.data();
+	}
+	GDALRasterBand* rb = ds->GetRasterBand(band);
+	int bcols, brows;
+	rb->GetBlockSize(&bcols, &brows);
+	// Edge blocks are read at their actual size into a full-size buffer.
+	int col = bcol * bcols;
+	int row = brow * brows;
+	int cols = std::min(bcols, ds->GetRasterXSize() - col);
+	int rows = std::min(brows, ds->GetRasterYSize() - row);
+	if(cols <= 0 || rows <= 0)
+		return nullptr;
+	std::vector<float> data((size_t) bcols * brows);
+	if(CE_None != rb->RasterIO(GF_Read, col, row, cols, rows, data.data(), cols, rows, GDT_Float32,
+			sizeof(float), (GSpacing) bcols * sizeof(float), 0))
+		return nullptr;
+	if(m_entries.size() >= m_capacity && !m_entries.empty()) {
+		m_index.erase(m_entries.back().first);
+		m_entries.pop_back();
+	}
+	m_entries.emplace_front(key, std::move(data));
+	m_index[key] = m_entries.begin();
+	return m_entries.front().second.data();
+}
+
+void BlockCache::clear() {
+	m_entries.clear();
+	m_index.clear();
+}
+
+namespace {
+
+	constexpr double QUANTISE_SCALES[] = {1, 10, 100, 1000, 10000};	///<! The scales tried when quantising a tile, in order.
+
+	/**
+	 * Quantise the values to int16 as q = round(v * scale) - shift, if there is a scale for
+	 * which (q + shift) / scale, cast back to T, reproduces every value exactly, and the range
+	 * of the scaled values fits in 16 bits.
+	 *
+	 * \param values The values.
+	 * \param n The number of values.
+	 * \param out The quantised values. Must have room for n values.
+	 * \param scale The scale used.
+	 * \param shift The shift used.
+	 * \return True if the values were quantised.
+	 */
+	template <class T>
+	bool quantise(const T* values, size_t n, int16_t* out, double& scale, double& shift) {
+		for(double s : QUANTISE_SCALES) {
+			double lo = std::numeric_limits<double>::max();
+			double hi = std::numeric_limits<double>::lowest();
+			size_t i = 0;
+			for(; i < n; ++i) {
+				double q = std::round((double) values[i] * s);
+				if(!std::isfinite(q) || (T) (q / s) != values[i])
+					break;
+				lo = std::min(lo, q);
+				hi = std::max(hi, q);
+			}
+			if(i < n)
+				continue;
+			// A larger scale only widens the range.
+			if(hi - lo > 65535)
+				return false;
+			scale = s;
+			shift = lo + 32768;
+			for(i = 0; i < n; ++i)
+				out[i] = (int16_t) (std::round((double) values[i] * s) - shift);
+			return true;
+		}
+		return false;
+	}
+
+	/**
+	 * Reverse quantise.
+	 *
+	 * \param in The quantised values.
+	 * \param n The number of values.
+	 * \param out The values. Must have room for n values.
+	 * \param scale The scale.
+	 * \param shift The shift.
+	 */
+	template <class T>
+	void dequantise(const int16_t* in, size_t n, T* out, double scale, double shift) {
+		for(size_t i = 0; i < n; ++i)
+			out[i] = (T) ((in[i] + shift) / scale);
+	}
+
+	bool quantise(GDALDataType type, const char* values, size_t n, int16_t* out, double& scale, double& shift) {
+		switch(type) {
+		case GDT_Float32: return quantise((const float*) values, n, out, scale, shift);
+		case GDT_Float64: return quantise((const double*) values, n, out, scale, shift);
+		case GDT_UInt32: return quantise((const uint32_t*) values, n, out, scale, shift);
+		case GDT_Int32: return quantise((const int32_t*) values, n, out, scale, shift);
+		default: return false;
+		}
+	}
+
+	void dequantise(GDALDataType type, const int16_t* in, size_t n, char* out, double scale, double shift) {
+		switch(type) {
+		case GDT_Float32: dequantise(in, n, (float*) out, scale, shift); break;
+		case GDT_Float64: dequantise(in, n, (double*) out, scale, shift); break;
+		case GDT_UInt32: dequantise(in, n, (uint32_t*) out, scale, shift); break;
+		case GDT_Int32: dequantise(in, n, (int32_t*) out, scale, shift); break;
+		default: throw std::runtime_error("Unsupported type for a quantised tile.");
+		}
+	}
+
+	/**
+	 * Gather the bytes of the values into planes: all the first bytes, then all the
+	 * second bytes, and so on.
+	 *
+	 * \param in The values.
+	 * \param n The number of values.
+	 * \param width The size in bytes of a value.
+	 * \param out The planes. Must have room for n * width bytes.
+	 */
+	void shuffle(const char* in, size_t n, int width, char* out) {
+		for(int b = 0; b < width; ++b) {
+			char* plane = out + b * n;
+			for(size_t i = 0; i < n; ++i)
+				plane[i] = in[i * width + b];
+		}
+	}
+
+	/**
+	 * Reverse shuffle.
+	 *
+	 * \param in The planes.
+	 * \param n The number of values.
+	 * \param width The size in bytes of a value.
+	 * \param out The values. Must have room for n * width bytes.
+	 */
+	void unshuffle(const char* in, size_t n, int width, char* out) {
+		for(int b = 0; b < width; ++b) {
+			const char* plane = in + b * n;
+			for(size_t i = 0; i < n; ++i)
+				out[i * width + b] = plane[i];
+		}
+	}
+
+} // anon
+
+CompressedCube::CompressedCube(int cols, int rows, int bands, GDALDataType type, int tileRows, bool quantise, size_t capacity) :
+	m_file(new TmpFile()),
+	m_end(0),
+	m_tiles((rows + tileRows - 1) / tileRows),
+	m_cols(cols), m_rows(rows), m_bands(bands),
+	m_tileRows(tileRows),
+	m_type(type),
+	m_typeSize(GDALGetDataTypeSizeBytes(type)),
+	m_quantise(quantise),
+	m_capacity(std::max((size_t) 1, capacity)) {
+}
+
+int CompressedCube::tileRows() const {
+	return m_tileRows;
+}
+
+size_t CompressedCube::tiles() const {
+	return m_tiles.size();
+}
+
+int CompressedCube::tileRows(size_t tile) const {
+	return std::min(m_tileRows, m_rows - (int) tile * m_tileRows);
+}
+
+uint64_t CompressedCube::storedSize() const {
+	return m_end;
+}
+
+void CompressedCube::put(size_t tile, std::vector<char>& data, std::vector<char>& buf) {
+	Tile& t = m_tiles[tile];
+	size_t n = (size_t) tileRows(tile) * m_cols * m_bands;
+	int width = m_typeSize;
+	t.quantised = false;
+	t.scale = 1;
+	t.shift = 0;
+
+	// Ping-pong between the two buffers; plain holds the latest stage.
+	std::vector<char>* plain = &data;
+	std::vector<char>* out = &buf;
+	out->resize(n * sizeof(int16_t));
+	if(m_quantise && m_typeSize > 2 && quantise(m_type, plain->data(), n, (int16_t*) out->data(), t.scale, t.shift)) {
+		t.quantised = true;
+		width = sizeof(int16_t);
+		std::swap(plain, out);
+	}
+	size_t bytes = n * width;
+	out->resize(bytes);
+	shuffle(plain->data(), n, width, out->data());
+	std::swap(plain, out);
+
+	// Keep the shuffled bytes if deflate doesn't make them smaller.
+	size_t size = 0;
+	t.deflated = CPLZLibDeflate(plain->data(), bytes, 1, out->data(), bytes, &size) && size < bytes;
+	const char* src = t.deflated ? out->data() : plain->data();
+	if(!t.deflated)
+		size = bytes;
+
+	t.size = (uint32_t) size;
+	t.offset = m_end.fetch_add(size);
+	uint64_t off = t.offset;
+	while(size) {
+		ssize_t w = pwrite(m_file->fd, src, size, off);
+		if(w < 0) {
+			if(errno == EINTR)
+				continue;
+			throw std::runtime_error(std::string("Failed to write compressed tile: ") + strerror(errno));
+		}
+		src += w;
+		size -= w;
+		off += w;
+	}
+}
+
+const char* CompressedCube::pixel(int col, int row) {
+	size_t tile = row / m_tileRows;
+	size_t offset = ((size_t) (row - tile * m_tileRows) * m_cols + col) * m_bands * m_typeSize;
+
+	// Consecutive reads are nearly always from the same tile.
+	if(!m_entries.empty() && m_entries.front().first == tile)
+		return m_entries.front().second.data() + offset;
+
+	auto it = m_index.find(tile);
+	if(it != m_index.end()) {
+		m_entries.splice(m_entries.begin(), m_entries, it->second);
+		return m_entries.front().second.data() + offset;
+	}
+
+	// Reuse the evicted tile's memory.
+	std::vector<char> data;
+	if(m_entries.size() >= m_capacity) {
+		data.swap(m_entries.back().second);
+		m_index.erase(m_entries.back().first);
+		m_entries.pop_back();
+	}
+
+	const Tile& t = m_tiles[tile];
+	size_t n = (size_t) tileRows(tile) * m_cols * m_bands;
+	int width = t.quantised ? sizeof(int16_t) : m_typeSize;
+	size_t bytes = n * width;
+
+	m_scratch.resize(t.size);
+	char* dst = m_scratch.data();
+	size_t size = t.size;
+	uint64_t off = t.offset;
+	while(size) {
+		ssize_t r = pread(m_file->fd, dst, size, off);
+		if(r <= 0) {
+			if(r < 0 && errno == EINTR)
+				continue;
+			throw std::runtime_error(std::string("Failed to read compressed tile: ") + (r ? strerror(errno) : "short read"));
+		}
+		dst += r;
+		size -= r;
+		off += r;
+	}
+
+	if(t.deflated) {
+		data.resize(bytes);
+		size_t len = 0;
+		if(!CPLZLibInflate(m_scratch.data(), t.size, data.data(), bytes, &len) || len != bytes)
+			throw std::runtime_error("Failed to inflate compressed tile.");
+		m_scratch.swap(data);
+	}
+	data.resize(bytes);
+	unshuffle(m_scratch.data(), n, width, data.data());
+	if(t.quantised) {
+		m_scratch.resize(n * m_typeSize);
+		dequantise(m_type, (const int16_t*) data.data(), n, m_scratch.data(), t.scale, t.shift);
+		m_scratch.swap(data);
+	}
+
+	m_entries.emplace_front(tile, std::move(data));
+	m_index[tile] = m_entries.begin();
+	return m_entries.front().second.data() + offset;
+}
+
+namespace {
+
+	/**
+	 * Worker for GDALReader::sample. Takes groups of points that fall in the same block
+	 * from the shared counter and copies each point's values for every band.
+	 *
+	 * \param ds The dataset to read, or nullptr to open the file for this worker.
+	 * \param cache The block cache to use, or nullptr to use one local to this worker.
+	 * \param filename The raster filename.
+	 * \param order The points' indices, sorted by block.
+	 * \param groups The start of each block's run of points in order, plus the end.
+	 * \param cols The points' columns.
+	 * \param rows The points' rows.
+	 * \param bands The number of bands.
+	 * \param values The output values.
+	 * \param nextGroup The counter of the next group to process.
+	 */
+	void sampleBlocks(GDALDataset* ds, BlockCache* cache, const std::string& filename,
+			const std::vector<size_t>& order, const std::vector<size_t>& groups,
+			const std::vector<int>& cols, const std::vector<int>& rows,
+			int bands, double* values, std::atomic<size_t>* nextGroup) {
+
+		auto closer = [](GDALDataset* d) { GDALClose(d); };
+		std::unique_ptr<GDALDataset, decltype(closer)> own(nullptr, closer);
+		if(!ds) {
+			own.reset((GDALDataset*) GDALOpen(filename.c_str(), GA_ReadOnly));
+			if(!own)
+				throw std::runtime_error("Failed to open dataset " + filename);
+			ds = own.get();
+		}
+		// One block of every band is enough, since each block is visited once.
+		BlockCache local(bands);
+		if(!cache)
+			cache = &local;
+
+		int bcols, brows;
+		ds->GetRasterBand(1)->GetBlockSize(&bcols, &brows);
+
+		size_t g;
+		while((g = (*nextGroup)++) < groups.size() - 1) {
+			size_t first = order[groups[g]];
+			int bcol = cols[first] / bcols;
+			int brow = rows[first] / brows;
+			for(int b = 0; b < bands; ++b) {
+				const float* block = cache->get(ds, b + 1, bcol, brow);
+				for(size_t i = groups[g]; i < groups[g + 1]; ++i) {
+					size_t p = order[i];
+					values[p * bands + b] = block ? block[(rows[p] % brows) * bcols + cols[p] % bcols] : 0;
+				}
+			}
+		}
+	}
+
+} // anon
+
+size_t GDALReader::sample(const std::vector<int>& cols, const std::vector<int>& rows, std::vector<double>& values, int threads) {
+	if(cols.size() != rows.size())
+		throw std::invalid_argument("The column and row lists must be the same size.");
+
+	size_t n = cols.size();
+	values.assign(n * m_bands, 0);
+
+	int bcols, brows;
+	blockSize(bcols, brows);
+	size_t nbcols = (m_cols + bcols - 1) / bcols;
+
+	// Sort the points inside the raster by block, then find the start of each block's run.
+	std::vector<std::pair<size_t, size_t>> keys;
+	keys.reserve(n);
+	for(size_t i = 0; i < n; ++i) {
+		if(cols[i] >= 0 && cols[i] < m_cols && rows[i] >= 0 && rows[i] < m_rows)
+			keys.emplace_back((size_t) (rows[i] / brows) * nbcols + cols[i] / bcols, i);
+	}
+	std::sort(keys.begin(), keys.end());
+	std::vector<size_t> order(keys.size());
+	std::vector<size_t> groups;
+	for(size_t i = 0; i < keys.size(); ++i) {
+		order[i] = keys[i].second;
+		if(!i || keys[i].first != keys[i - 1].first)
+			groups.push_back(i);
+	}
+	groups.push_back(keys.size());
+	size_t blocks = groups.size() - 1;
+
+	if(threads <= 0)
+		threads = std::max(1u, std::thread::hardware_concurrency());
+	threads = (int) std::min((size_t) threads, blocks);
+
+	std::atomic<size_t> nextGroup(0);
+	if(threads <= 1) {
+		sampleBlocks(m_ds, &m_blockCache, m_filename, order, groups, cols, rows, m_bands, values.data(), &nextGroup);
+	} else {
+		std::vector<std::future<void>> workers;
+		for(int i = 0; i < threads; ++i) {
+			workers.push_back(std::async(std::launch::async, &sampleBlocks, nullptr, nullptr, std::cref(m_filename),
+					std::cref(order), std::cref(groups), std::cref(cols), std::cref(rows), m_bands, values.data(), &nextGroup));
+		}
+		std::exception_ptr ex;
+		for(std::future<void>& w : workers) {
+			try {
+				w.get();
+			} catch(...) {
+				// Stop the other workers and report the first failure.
+				if(!ex)
+					ex = std::current_exception();
+				nextGroup = groups.size();
+			}
+		}
+		if(ex)
+			std::rethrow_exception(ex);
+	}
+	return keys.size();
+}
+
+size_t GDALReader::sample(const std::vector<double>& xs, const std::vector<double>& ys, std::vector<double>& values, int threads) {
+	if(xs.size() != ys.size())
+		throw std::invalid_argument("The x and y lists must be the same size.");
+	std::vector<int> cols(xs.size());
+	std::vector<int> rows(ys.size());
+	for(size_t i = 0; i < xs.size(); ++i) {
+		cols[i] = toCol(xs[i]);
+		rows[i] = toRow(ys[i]);
+	}
+	return sample(cols, rows, values, threads);
+}
+
+bool GDALReader::next(std::string& id, std::vector<double>& buf, int& cols, int& col, int& row) {
+
+	id = "";
+	cols = m_cols;
+	col = m_col;
+	row = m_row;
+
+	if(m_row >= m_rows)
+		return false;
+
+	if(m_mapped || m_cube) {
 
 		if(!mapped(m_col, m_row, buf))
 			return false;
@@ -571,27 +2056,169 @@ bool GDALReader::next(std::string& id, std::vector<double>& buf, int& cols, int&
 			++m_row;
 		}
 
+	} else if(m_prefetchRows > 0) {
+
+		// Restart the prefetch if the consumer has jumped or the band range has changed.
+		if(!m_prefetch || m_row != m_prefetchExpect || readBands() != m_prefetchBands)
+			startPrefetch(m_row);
+
+		size_t slot = m_row % m_prefetchRows;
+		bool ok;
+		{
+			std::unique_lock<std::mutex> lk(m_prefetchMtx);
+			m_prefetchCv.wait(lk, [&]{ return m_ringRow[slot] == m_row; });
+			// Hand the caller the prefetched row and give the ring the caller's buffer.
+			buf.swap(m_ring[slot]);
+			ok = m_ringOk[slot];
+			m_ringRow[slot] = -1;
+		}
+		m_prefetchCv.notify_all();
+
+		m_prefetchExpect = ++m_row;
+		if(!ok)
+			return false;
+
 	} else {
 
-		int numBands = m_maxIdx - m_minIdx + 1;
+		if(!readBIP(0, m_row, m_cols, 1, readBands(), buf))
+			return false;
 
-		buf.resize(m_cols * numBands);
-		std::fill(buf.begin(), buf.end(), 0);
+		++m_row;
+	}
 
-		double* data = (double*) buf.data();
-		for(int i = m_minIdx; i <= m_maxIdx; ++i) {
-			//std::cerr << "band " << i << "\n";
-			GDALRasterBand* band = m_ds->GetRasterBand(i);
-			if(CE_None != band->RasterIO(GF_Read, 0, m_row, m_cols, 1, (void*) (data + i - m_minIdx), m_cols, 1, GDT_Float64, numBands * sizeof(double), 0, 0))
-				return false;
+	return true;
+}
+
+bool GDALReader::nextBlock(SpectralBlock& block, size_t maxCount) {
+
+	if(m_row >= m_rows)
+		return false;
+
+	if(m_cube) {
+
+		// Stop at the end of the tile, since the next one may evict it.
+		size_t tileEnd = (size_t) std::min(m_rows, (m_row / m_cube->tileRows() + 1) * m_cube->tileRows()) * m_cols;
+		size_t start = (size_t) m_row * m_cols + m_col;
+		size_t count = std::min(tileEnd - start, maxCount ? maxCount : (size_t) m_cols);
+		block.resize(count, m_mappedBands);
+		GDALCopyWords64(m_cube->pixel(m_col, m_row), m_mappedType, m_mappedTypeSize, block.buf.data(), GDT_Float64, sizeof(double), (GIntBig) count * m_mappedBands);
+
+		for(size_t i = 0; i < count; ++i) {
+			block.cols[i] = m_col;
+			block.rows[i] = m_row;
+			if(++m_col >= m_cols) {
+				m_col = 0;
+				++m_row;
+			}
 		}
 
-		++m_row;
+	} else if(m_mapped) {
+
+		size_t start = (size_t) m_row * m_cols + m_col;
+		size_t count = std::min((size_t) m_cols * m_rows - start, maxCount ? maxCount : (size_t) m_cols);
+		const char* src = m_mapped + start * m_mappedStride * m_mappedTypeSize;
+
+		if(m_mappedType == GDT_Float64 && m_mappedStride == m_mappedBands && ((uintptr_t) src % alignof(double)) == 0) {
+			// The spectra can be used where they are.
+			block.resize(count, m_mappedBands, false);
+			block.data = (const double*) src;
+		} else if(m_mappedStride == m_mappedBands) {
+			block.resize(count, m_mappedBands);
+			GDALCopyWords64(src, m_mappedType, m_mappedTypeSize, block.buf.data(), GDT_Float64, sizeof(double), (GIntBig) count * m_mappedBands);
+		} else {
+			block.resize(count, m_mappedBands);
+			for(size_t i = 0; i < count; ++i) {
+				GDALCopyWords(src + i * m_mappedStride * m_mappedTypeSize, m_mappedType, m_mappedTypeSize,
+						block.buf.data() + i * m_mappedBands, GDT_Float64, sizeof(double), m_mappedBands);
+			}
+		}
+
+		for(size_t i = 0; i < count; ++i) {
+			block.cols[i] = m_col;
+			block.rows[i] = m_row;
+			if(++m_col >= m_cols) {
+				m_col = 0;
+				++m_row;
+			}
+		}
+
+	} else {
+
+		// Whole rows, through the prefetch ring if there is one.
+		std::string id;
+		int cols, col, row;
+		if(!next(id, block.buf, cols, col, row))
+			return false;
+		block.resize(m_cols, (int) block.buf.size() / std::max(1, m_cols), false);
+		block.data = block.buf.data();
+		for(int c = 0; c < m_cols; ++c) {
+			block.cols[c] = c;
+			block.rows[c] = row;
+		}
 	}
 
 	return true;
 }
 
+void GDALReader::setPrefetchRows(int rows) {
+	stopPrefetch();
+	m_prefetchRows = std::max(0, rows);
+}
+
+void GDALReader::startPrefetch(int row) {
+	stopPrefetch();
+	m_ring.resize(m_prefetchRows);
+	m_ringRow.assign(m_prefetchRows, -1);
+	m_ringOk.assign(m_prefetchRows, false);
+	m_prefetchStop = false;
+	m_prefetchBands = readBands();
+	m_prefetchExpect = row;
+	m_prefetch.reset(new std::thread(&GDALReader::prefetch, this, row));
+}
+
+void GDALReader::stopPrefetch() {
+	if(!m_prefetch)
+		return;
+	{
+		std::lock_guard<std::mutex> lk(m_prefetchMtx);
+		m_prefetchStop = true;
+	}
+	m_prefetchCv.notify_all();
+	m_prefetch->join();
+	m_prefetch.reset();
+}
+
+void GDALReader::prefetch(int row) {
+	GDALDataset* ds = (GDALDataset*) GDALOpen(m_filename.c_str(), GA_ReadOnly);
+	std::vector<int> bandList(m_prefetchBands);
+	int bands = (int) bandList.size();
+
+	for(; row < m_rows; ++row) {
+		size_t slot = row % m_prefetchRows;
+		{
+			// Wait for the consumer to free the slot.
+			std::unique_lock<std::mutex> lk(m_prefetchMtx);
+			m_prefetchCv.wait(lk, [&]{ return m_prefetchStop || m_ringRow[slot] == -1; });
+			if(m_prefetchStop)
+				break;
+		}
+		// The consumer doesn't touch a free slot, so it can be filled without the lock.
+		std::vector<double>& buf = m_ring[slot];
+		buf.resize((size_t) m_cols * bands);
+		bool ok = ds && CE_None == ds->RasterIO(GF_Read, 0, row, m_cols, 1, buf.data(), m_cols, 1, GDT_Float64,
+				bands, bandList.data(), bands * sizeof(double), (GSpacing) m_cols * bands * sizeof(double), sizeof(double));
+		{
+			std::lock_guard<std::mutex> lk(m_prefetchMtx);
+			m_ringRow[slot] = row;
+			m_ringOk[slot] = ok;
+		}
+		m_prefetchCv.notify_all();
+	}
+
+	if(ds)
+		GDALClose(ds);
+}
+
 bool GDALReader::next(std::vector<double>& buf, int band, int& cols, int& col, int& row) {
 
 	if(m_row >= m_rows)
@@ -601,7 +2228,7 @@ bool GDALReader::next(std::vector<double>& buf, int band, int& cols, int& col, i
 	col = m_col;
 	row = m_row;
 
-	if(m_mapped) {
+	if(m_mapped || m_cube) {
 
 		std::vector<double> _buf;
 		if(!mapped(m_col, m_row, _buf))
@@ -617,7 +2244,6 @@ bool GDALReader::next(std::vector<double>& buf, int band, int& cols, int& col, i
 	} else {
 
 		buf.resize(m_cols);
-		std::fill(buf.begin(), buf.end(), 0);
 
 		GDALRasterBand* bd = m_ds->GetRasterBand(band);
 		if(CE_None != bd->RasterIO(GF_Read, 0, m_row, m_cols, 1, buf.data(), m_cols, 1, GDT_Float64, 0, 0, 0))
@@ -639,54 +2265,79 @@ void GDALReader::transform(double* trans) const {
 }
 
 GDALReader::~GDALReader() {
+	stopPrefetch();
 	GDALClose(m_ds);
-	if(m_mapped) {
-		if(m_mappedSize > m_memLimit) {
-			munmap(m_mapped, m_mappedSize);
-		} else {
-			free(m_mapped);
-		}
-	}
+	unmap();
 }
 
 
 
-ROIReader::ROIReader(const std::string& filename) : Reader() {
+ROIReader::ROIReader(const std::string& filename) : Reader(),
+	m_idx(0) {
 
-	// Attempt to read in the ROI file.
+	// Attempt to read in the ROI file. Pixels are collected in file order with
+	// their values in one list, then sorted by row and column.
 	std::ifstream input(filename, std::ios::in);
-	std::string buf, item;
-	std::vector<std::string> fields;
+	std::string buf;
+	std::vector<int> cols, rows;
+	std::vector<double> values;
+	std::vector<std::pair<const char*, const char*>> fields;
 	while(std::getline(input, buf)) {
-		if(buf[0] == ';') continue;
+		if(buf.empty() || buf[0] == ';') continue;
 
-		std::stringstream sbuf(buf);
-		while(std::getline(sbuf, item, ' ')) {
-			if(!item.empty())
-				fields.push_back(item);
+		fields.clear();
+		const char* p = buf.data();
+		const char* end = p + buf.size();
+		while(p < end) {
+			while(p < end && std::isspace(*p)) ++p;
+			const char* start = p;
+			while(p < end && !std::isspace(*p)) ++p;
+			if(p > start)
+				fields.emplace_back(start, p);
 		}
+		if(fields.size() < 3)
+			continue;
 
-		int col = atoi(fields[1].c_str());
-		int row = atoi(fields[2].c_str());
-
-		// Allocate and retrieve the pixel; set its coordinates.
-		detail::px& p = m_pixels[((long) col << 32) | row];
-		p.c = col;
-		p.r = row;
-
-		// Read the band values for the pixel.
-		for(size_t i = 3; i < fields.size(); ++i)
-			p.values.push_back(atof(fields[i].c_str()));
+		int col = 0, row = 0;
+		std::from_chars(fields[1].first, fields[1].second, col);
+		std::from_chars(fields[2].first, fields[2].second, row);
+		cols.push_back(col);
+		rows.push_back(row);
+
+		// Every pixel gets as many values as the first one.
+		if(m_bands == 0)
+			m_bands = fields.size() - 3;
+		for(int i = 0; i < m_bands; ++i) {
+			size_t f = 3 + i;
+			values.push_back(f < fields.size() ? parseDouble(fields[f].first, fields[f].second) : 0);
+		}
 
-		if(col > m_cols)
-			m_cols = col;
-		if(row > m_rows)
-			m_rows = row;
-		m_bands = p.values.size();
+		m_cols = std::max(m_cols, col + 1);
+		m_rows = std::max(m_rows, row + 1);
+	}
 
-		fields.clear();
+	// Sort by row, then column. Where a pixel is repeated, the last one wins.
+	std::vector<size_t> order(cols.size());
+	for(size_t i = 0; i < order.size(); ++i)
+		order[i] = i;
+	std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+		return rows[a] < rows[b] || (rows[a] == rows[b] && cols[a] < cols[b]);
+	});
+	for(size_t i = 0; i < order.size(); ++i) {
+		size_t j = order[i];
+		if(i + 1 < order.size() && rows[order[i + 1]] == rows[j] && cols[order[i + 1]] == cols[j])
+			continue;
+		m_pxCols.push_back(cols[j]);
+		m_pxRows.push_back(rows[j]);
+		m_values.insert(m_values.end(), values.begin() + j * m_bands, values.begin() + (j + 1) * m_bands);
 	}
+}
 
+void ROIReader::bandSpan(int& first, int& count) const {
+	// Use the band range if one is set, otherwise all bands.
+	first = m_maxIdx > 0 ? std::max(0, m_minIdx - 1) : 0;
+	int last = m_maxIdx > 0 ? std::min(m_bands, m_maxIdx) - 1 : m_bands - 1;
+	count = std::max(0, last - first + 1);
 }
 
 bool ROIReader::next(std::vector<double>& buf, int& col, int& row, int& cols, int& rows) {
@@ -697,8 +2348,6 @@ bool ROIReader::next(std::vector<double>& buf, int& col, int& row, int& cols, in
 	if(m_row >= m_rows)
 		return false;
 
-	std::fill(buf.begin(), buf.end(), 0);
-
 	col = m_col;
 	row = m_row;
 	cols = std::min(m_bufSize, m_cols - m_col);
@@ -706,24 +2355,208 @@ bool ROIReader::next(std::vector<double>& buf, int& col, int& row, int& cols, in
 
 	m_col += m_bufSize;
 
-	for(int i = m_minIdx; i <= m_maxIdx; ++i) {
-		for(int r = row; r < std::min(row + m_bufSize, m_rows); ++r) {
-			for(int c = col; c < std::min(col + m_bufSize, m_cols); ++c) {
-				long px = ((long) c << 32) | r;
-				if(m_pixels.find(px) != m_pixels.end()) {
-					int idx = (i - m_minIdx) * m_bufSize * m_bufSize + r * m_bufSize + c;
-					buf[idx] = m_pixels[px].values[i];
-				}
-			}
+	int first, bands;
+	bandSpan(first, bands);
+	size_t plane = (size_t) m_bufSize * m_bufSize;
+	buf.assign(plane * bands, 0);
+
+	// For each row of the window, find the first pixel at or after the window's first
+	// column, then scan along the row until the window's last column.
+	for(int r = row; r < row + rows; ++r) {
+		size_t i = std::distance(m_pxRows.begin(), std::lower_bound(m_pxRows.begin(), m_pxRows.end(), r));
+		while(i < m_pxRows.size() && m_pxRows[i] == r && m_pxCols[i] < col)
+			++i;
+		for(; i < m_pxRows.size() && m_pxRows[i] == r && m_pxCols[i] < col + cols; ++i) {
+			const double* px = m_values.data() + i * m_bands + first;
+			size_t idx = (size_t) (r - row) * m_bufSize + (m_pxCols[i] - col);
+			for(int b = 0; b < bands; ++b)
+				buf[b * plane + idx] = px[b];
 		}
 	}
 	return true;
 }
 
+bool ROIReader::next(std::string& id, std::vector<double>& buf, int& cols, int& col, int& row) {
+	if(m_idx >= m_pxCols.size())
+		return false;
+	int first, bands;
+	bandSpan(first, bands);
+	const double* px = m_values.data() + m_idx * m_bands + first;
+	id = "";
+	cols = 1;
+	col = m_pxCols[m_idx];
+	row = m_pxRows[m_idx];
+	buf.assign(px, px + bands);
+	++m_idx;
+	return true;
+}
+
+bool ROIReader::nextBlock(SpectralBlock& block, size_t maxCount) {
+	if(m_idx >= m_pxCols.size())
+		return false;
+	int first, bands;
+	bandSpan(first, bands);
+	size_t count = std::min(m_pxCols.size() - m_idx, maxCount ? maxCount : (size_t) m_bufSize);
+	if(bands == m_bands) {
+		// All bands are wanted, so the block is a view of the value matrix.
+		block.resize(count, bands, false);
+		block.data = m_values.data() + m_idx * m_bands;
+	} else {
+		block.resize(count, bands);
+		for(size_t i = 0; i < count; ++i) {
+			const double* px = m_values.data() + (m_idx + i) * m_bands + first;
+			std::copy(px, px + bands, block.buf.data() + i * bands);
+		}
+	}
+	std::copy(m_pxCols.begin() + m_idx, m_pxCols.begin() + m_idx + count, block.cols.begin());
+	std::copy(m_pxRows.begin() + m_idx, m_pxRows.begin() + m_idx + count, block.rows.begin());
+	m_idx += count;
+	return true;
+}
+
 ROIReader::~ROIReader() {
 }
 
 
+SLIReader::SLIReader(const std::string& filename) : Reader(),
+	m_mapped(nullptr), m_mappedSize(0),
+	m_data(nullptr),
+	m_type(GDT_Unknown), m_typeSize(0),
+	m_swap(false),
+	m_idx(0) {
+
+	m_filename = filename;
+
+	envi::Header hdr;
+	std::string hdrFile = envi::headerFile(filename);
+	if(hdrFile.empty() || !envi::readHeader(hdrFile, hdr))
+		throw std::runtime_error("Failed to read the header for spectral library " + filename);
+	// A library has one spectrum per line, with a value for each sample.
+	if(hdr.bands != 1 || hdr.samples <= 0 || hdr.lines < 0)
+		throw std::runtime_error("Not a spectral library: " + filename);
+	if((int) hdr.wavelengths.size() != hdr.samples)
+		throw std::runtime_error("The spectral library has no wavelengths, or the wrong number: " + filename);
+	if((m_type = hdr.gdalType()) == GDT_Unknown)
+		throw std::runtime_error("Unsupported data type in spectral library: " + filename);
+	m_typeSize = GDALGetDataTypeSizeBytes(m_type);
+	m_swap = !hdr.hostOrder();
+
+	m_cols = 1;
+	m_rows = hdr.lines;
+	m_bands = hdr.samples;
+	if(hdr.fields.count("spectra names"))
+		m_ids = hdr.bandNames;
+	m_ids.resize(m_ids.empty() ? 0 : m_rows);
+
+	size_t dataSize = (size_t) m_rows * m_bands * m_typeSize;
+	int fd = open(filename.c_str(), O_RDONLY);
+	if(fd < 0)
+		throw std::runtime_error("Failed to open spectral library " + filename + ": " + strerror(errno));
+	struct stat st;
+	fstat(fd, &st);
+	m_mappedSize = st.st_size;
+	if(m_mappedSize < hdr.headerOffset + dataSize) {
+		::close(fd);
+		throw std::runtime_error("The spectral library is shorter than its header says: " + filename);
+	}
+	if(m_mappedSize) {
+		void* mapped = mmap(0, m_mappedSize, PROT_READ, MAP_SHARED, fd, 0);
+		if(mapped == MAP_FAILED) {
+			::close(fd);
+			throw std::runtime_error("Failed to map spectral library " + filename + ": " + strerror(errno));
+		}
+		m_mapped = (char*) mapped;
+		m_data = m_mapped + hdr.headerOffset;
+		madvise(m_mapped, m_mappedSize, MADV_SEQUENTIAL);
+	}
+	::close(fd);
+
+	std::map<int, int> map;
+	for(int i = 0; i < m_bands; ++i)
+		map[(int) (hdr.wavelengths[i] * WL_SCALE)] = i + 1;
+	setBandMap(map);
+}
+
+bool SLIReader::isLibrary(const std::string& filename) {
+	std::string hdrFile = envi::headerFile(filename);
+	if(hdrFile.empty())
+		return false;
+	if(lowercase(extension(filename)) == ".sli")
+		return true;
+	envi::Header hdr;
+	return envi::readHeader(hdrFile, hdr) && lowercase(hdr.fileType).find("spectral library") != std::string::npos;
+}
+
+void SLIReader::bandSpan(int& first, int& count) const {
+	// Use the band range if one is set, otherwise all bands.
+	first = m_maxIdx > 0 ? std::max(0, m_minIdx - 1) : 0;
+	int last = m_maxIdx > 0 ? std::min(m_bands, m_maxIdx) - 1 : m_bands - 1;
+	count = std::max(0, last - first + 1);
+}
+
+void SLIReader::copySpectra(size_t idx, size_t count, int first, int bands, double* out) const {
+	std::vector<char> swapped(m_swap ? (size_t) bands * m_typeSize : 0);
+	for(size_t i = 0; i < count; ++i) {
+		const char* src = m_data + ((idx + i) * m_bands + first) * m_typeSize;
+		if(m_swap) {
+			std::memcpy(swapped.data(), src, swapped.size());
+			GDALSwapWords(swapped.data(), m_typeSize, bands, m_typeSize);
+			src = swapped.data();
+		}
+		GDALCopyWords64(src, m_type, m_typeSize, out + i * bands, GDT_Float64, sizeof(double), bands);
+	}
+}
+
+void SLIReader::reset() {
+	m_idx = 0;
+}
+
+bool SLIReader::next(std::string& id, std::vector<double>& buf, int& cols, int& col, int& row) {
+	if(m_idx >= m_rows)
+		return false;
+	int first, bands;
+	bandSpan(first, bands);
+	buf.resize(bands);
+	copySpectra(m_idx, 1, first, bands, buf.data());
+	id = m_ids.empty() ? "" : m_ids[m_idx];
+	cols = 1;
+	col = 0;
+	row = m_idx;
+	++m_idx;
+	return true;
+}
+
+bool SLIReader::nextBlock(SpectralBlock& block, size_t maxCount) {
+	if(m_idx >= m_rows)
+		return false;
+	int first, bands;
+	bandSpan(first, bands);
+	size_t count = std::min((size_t) (m_rows - m_idx), maxCount ? maxCount : (size_t) m_bufSize);
+	const char* src = m_data + (size_t) m_idx * m_bands * m_typeSize;
+	if(bands == m_bands && m_type == GDT_Float64 && !m_swap && (uintptr_t) src % alignof(double) == 0) {
+		// Whole spectra of native doubles, so the block is a view of the mapping.
+		block.resize(count, bands, false);
+		block.data = (const double*) src;
+	} else {
+		block.resize(count, bands);
+		copySpectra(m_idx, count, first, bands, block.buf.data());
+	}
+	if(!m_ids.empty())
+		block.ids.assign(m_ids.begin() + m_idx, m_ids.begin() + m_idx + count);
+	for(size_t i = 0; i < count; ++i) {
+		block.cols[i] = 0;
+		block.rows[i] = m_idx + i;
+	}
+	m_idx += count;
+	return true;
+}
+
+SLIReader::~SLIReader() {
+	if(m_mapped)
+		munmap(m_mapped, m_mappedSize);
+}
+
+
 BandMapReader::BandMapReader(const std::string& filename, int wlCol, int idxCol, bool hasHeader) {
 
 	std::ifstream input(filename, std::ios::in);
@@ -765,6 +2598,157 @@ const std::map<int, int>& BandMapReader::bandMap() const {
 
 
 
+namespace {
+
+/**
+ * Branch-free lower bound on a sorted array. Returns the index of the first
+ * key not less than the given key, or n if there is none.
+ *
+ * \param keys A sorted array of keys.
+ * \param n The number of keys.
+ * \param key The key to search for.
+ * \return The index of the first key not less than key.
+ */
+template <class K>
+size_t lowerBound(const K* keys, size_t n, K key) {
+	if(!n)
+		return 0;
+	const K* base = keys;
+	while(n > 1) {
+		size_t half = n / 2;
+		base = base[half] < key ? base + half : base;
+		n -= half;
+	}
+	return (base - keys) + (*base < key);
+}
+
+/**
+ * Lower bound search starting from a hint. Gallops away from the hint in
+ * doubling steps to bracket the key, then binary searches the bracket, so
+ * the cost is logarithmic in the distance from the hint rather than in n.
+ *
+ * \param keys A sorted array of keys.
+ * \param n The number of keys.
+ * \param key The key to search for.
+ * \param hint The index at which to start searching.
+ * \return The index of the first key not less than key.
+ */
+template <class K>
+size_t gallopLowerBound(const K* keys, size_t n, K key, size_t hint) {
+	if(hint > n)
+		hint = n;
+	size_t lo, hi, step = 1;
+	if(hint < n && keys[hint] < key) {
+		// The result is above the hint.
+		lo = hint + 1;
+		while(hint + step < n && keys[hint + step] < key) {
+			lo = hint + step + 1;
+			step <<= 1;
+		}
+		hi = std::min(hint + step, n);
+	} else {
+		// The result is at or below the hint.
+		hi = hint;
+		while(step <= hint && !(keys[hint - step] < key)) {
+			hi = hint - step;
+			step <<= 1;
+		}
+		lo = step <= hint ? hint - step + 1 : 0;
+	}
+	return lo + lowerBound(keys + lo, hi - lo, key);
+}
+
+/**
+ * Return the index of the key nearest to the given key, given its lower bound.
+ * Ties go to the lower key. The array must not be empty.
+ *
+ * \param keys A sorted array of keys.
+ * \param n The number of keys.
+ * \param key The key to search for.
+ * \param i The lower bound of the key.
+ * \return The index of the nearest key.
+ */
+template <class K>
+size_t nearestIndex(const K* keys, size_t n, K key, size_t i) {
+	if(i == n)
+		return n - 1;
+	if(i > 0 && key - keys[i - 1] <= keys[i] - key)
+		return i - 1;
+	return i;
+}
+
+/**
+ * Sort the pairs by key (the input is usually already sorted, in which case
+ * this is a linear check) and split them into parallel key and value arrays.
+ *
+ * \param items A list of key/value pairs.
+ * \param keys A vector to receive the sorted keys.
+ * \param values A vector to receive the values corresponding to the keys.
+ */
+template <class K, class V>
+void buildIndex(std::vector<std::pair<K, V>>& items, std::vector<K>& keys, std::vector<V>& values) {
+	auto cmp = [](const std::pair<K, V>& a, const std::pair<K, V>& b) { return a.first < b.first; };
+	if(!std::is_sorted(items.begin(), items.end(), cmp))
+		std::stable_sort(items.begin(), items.end(), cmp);
+	keys.resize(items.size());
+	values.resize(items.size());
+	for(size_t i = 0; i < items.size(); ++i) {
+		keys[i] = items[i].first;
+		values[i] = items[i].second;
+	}
+}
+
+/**
+ * Linearly interpolate the value at the given key from the bracketing entries
+ * in a sorted index. Keys outside the index are clamped to the first or last value.
+ * The index must not be empty.
+ *
+ * \param keys The sorted keys.
+ * \param values The values corresponding to the keys.
+ * \param key The key to search for.
+ * \param i The lower bound of the key.
+ * \return The interpolated value.
+ */
+long interpolate(const std::vector<long>& keys, const std::vector<long>& values, long key, size_t i) {
+	size_t n = keys.size();
+	if(i == n)
+		return values[n - 1];
+	if(i == 0 || keys[i] == key)
+		return values[i];
+	long k0 = keys[i - 1], k1 = keys[i];
+	long v0 = values[i - 1], v1 = values[i];
+	return v0 + (v1 - v0) * (key - k0) / (k1 - k0);
+}
+
+constexpr size_t MIN_BATCH_CHUNK = 4096; ///<! The smallest number of lookups given to a batch worker.
+
+/**
+ * Split the range [0, n) into contiguous chunks and run the function on each
+ * in parallel. Small ranges are run on the calling thread.
+ *
+ * \param n The size of the range.
+ * \param threads The number of threads to use. If zero, uses the hardware concurrency.
+ * \param fn A function taking the start and end of a chunk.
+ */
+template <class F>
+void parallelChunks(size_t n, int threads, F fn) {
+	if(threads <= 0)
+		threads = std::max(1u, std::thread::hardware_concurrency());
+	size_t chunks = std::min((size_t) threads, (n + MIN_BATCH_CHUNK - 1) / MIN_BATCH_CHUNK);
+	if(chunks <= 1) {
+		fn(0, n);
+		return;
+	}
+	size_t step = (n + chunks - 1) / chunks;
+	std::vector<std::future<void>> workers;
+	for(size_t start = 0; start < n; start += step)
+		workers.push_back(std::async(std::launch::async, fn, start, std::min(n, start + step)));
+	for(std::future<void>& w : workers)
+		w.get();
+}
+
+} // anon
+
 FrameIndexReader::FrameIndexReader(const std::string& filename) {
 	std::ifstream in(filename, std::ios::in);
 	std::string frame, time;
@@ -773,7 +2757,8 @@ FrameIndexReader::FrameIndexReader(const std::string& filename) {
 	if(in.good())
 		std::getline(in, frame, '\n');
 	// Read the data.
-	std::list<std::pair<int, long> > items;
+	std::vector<std::pair<int, long>> byFrame;
+	std::vector<std::pair<long, int>> byTime;
 	while(in.good()) {
 		std::getline(in, frame, '\t'); // TODO: Configurable delimiter.
 		std::getline(in, time, '\n');
@@ -781,67 +2766,84 @@ FrameIndexReader::FrameIndexReader(const std::string& filename) {
 			continue;
 		if((rpos = time.find('\r')) != std::string::npos)
 			time.replace(rpos, 1, 0, 'x');
-		items.push_back(std::make_pair(std::stoi(frame), std::stol(time)));
-	}
-
-	{
-		auto it = items.begin();
-		std::advance(it, items.size() / 2);
-		int mframe = it->first;
-		int mtime = it->second;
-		m_frames = new BinTree<long, int>(mtime, mframe);
-		m_times = new BinTree<int, long>(mframe, mtime);
-	}
-
-	for(auto p : items) {
-		m_frames->add(p.second, p.first);
-		m_times->add(p.first, p.second);
+		int f = std::stoi(frame);
+		long t = std::stol(time);
+		byFrame.emplace_back(f, t);
+		byTime.emplace_back(t, f);
 	}
+	buildIndex(byFrame, m_frames, m_frameTimes);
+	buildIndex(byTime, m_times, m_timeFrames);
 };
 
 bool FrameIndexReader::getTime(int frame, long& time) const {
-	long t;
-	if(m_times->get(frame, t)) {
-		time = t;
+	size_t i = lowerBound(m_frames.data(), m_frames.size(), frame);
+	if(i < m_frames.size() && m_frames[i] == frame) {
+		time = m_frameTimes[i];
 		return true;
 	}
 	return false;
 }
 
 bool FrameIndexReader::getNearestTime(int frame, int& actualFrame, long& time) const {
-	long t;
-	int f;
-	if(m_times->findNearest(frame, f, t)) {
-		actualFrame = f;
-		time = t;
-		return true;
-	}
-	return false;
+	if(m_frames.empty())
+		return false;
+	size_t i = lowerBound(m_frames.data(), m_frames.size(), frame);
+	i = nearestIndex(m_frames.data(), m_frames.size(), frame, i);
+	actualFrame = m_frames[i];
+	time = m_frameTimes[i];
+	return true;
 }
 
 bool FrameIndexReader::getFrame(long time, int& frame) const {
-	int f;
-	if(m_frames->get(time, f)) {
-		frame = f;
+	size_t i = lowerBound(m_times.data(), m_times.size(), time);
+	if(i < m_times.size() && m_times[i] == time) {
+		frame = m_timeFrames[i];
 		return true;
 	}
 	return false;
 }
 
 bool FrameIndexReader::getNearestFrame(long time, long& actualTime, int& frame) const {
-	long t;
-	int f;
-	if(m_frames->findNearest(time, t, f)) {
-		actualTime = t;
-		frame = f;
-		return true;
-	}
-	return false;
+	if(m_times.empty())
+		return false;
+	size_t i = lowerBound(m_times.data(), m_times.size(), time);
+	i = nearestIndex(m_times.data(), m_times.size(), time, i);
+	actualTime = m_times[i];
+	frame = m_timeFrames[i];
+	return true;
+}
+
+bool FrameIndexReader::getNearestFrames(const std::vector<long>& times, std::vector<long>& actualTimes, std::vector<int>& frames, int threads) const {
+	if(m_times.empty())
+		return false;
+	actualTimes.resize(times.size());
+	frames.resize(times.size());
+	parallelChunks(times.size(), threads, [&](size_t start, size_t end) {
+		Cursor cur(*this);
+		for(size_t i = start; i < end; ++i)
+			cur.getNearestFrame(times[i], actualTimes[i], frames[i]);
+	});
+	return true;
+}
+
+FrameIndexReader::Cursor FrameIndexReader::cursor() const {
+	return Cursor(*this);
+}
+
+FrameIndexReader::Cursor::Cursor(const FrameIndexReader& reader) :
+	m_reader(&reader),
+	m_pos(0) {
 }
 
-FrameIndexReader::~FrameIndexReader() {
-	delete m_frames;
-	delete m_times;
+bool FrameIndexReader::Cursor::getNearestFrame(long time, long& actualTime, int& frame) {
+	const std::vector<long>& times = m_reader->m_times;
+	if(times.empty())
+		return false;
+	m_pos = gallopLowerBound(times.data(), times.size(), time, m_pos);
+	size_t i = nearestIndex(times.data(), times.size(), time, m_pos);
+	actualTime = times[i];
+	frame = m_reader->m_timeFrames[i];
+	return true;
 }
 
 IMUGPSRow::IMUGPSRow(std::istream& in, double msOffset) :
@@ -870,161 +2872,604 @@ IMUGPSRow::IMUGPSRow(std::istream& in, double msOffset) :
 }
 
 
-IMUGPSReader::IMUGPSReader(const std::string& filename, double msOffset) :
-	m_lastIndex(0) {
-	m_in.open(filename, std::ios::in);
-	// Skip the header.
-	std::string buf;
-	std::getline(m_in, buf, '\n');
-	std::list<IMUGPSRow*> rows;
-	while(std::getline(m_in, buf, '\n')) {
-		try {
-			rows.push_back(new IMUGPSRow(m_in, msOffset));
-		} catch(...) {
-			continue;
-		}
+IMUGPSRow::IMUGPSRow() :
+	roll(0), pitch(0), yaw(0),
+	lat(0), lon(0), alt(0),
+	gpsTime(0), utcTime(0),
+	status(0), heading(0),
+	index(0) {
+}
+
+namespace {
+
+	constexpr char IMUGPS_CACHE_MAGIC[8] = {'H', 'L', 'R', 'G', 'I', 'M', 'U', '1'};
+
+	/**
+	 * The header of a sidecar index or cache file. The size and modification
+	 * time identify the source file the sidecar was built from.
+	 */
+	struct SidecarHeader {
+		char magic[8];		///<! The magic string identifying the sidecar type.
+		uint64_t fileSize;	///<! The size of the source file.
+		int64_t mtime;		///<! The modification time of the source file, in nanoseconds.
+		uint64_t rows;		///<! The number of rows.
+	};
+
+	/**
+	 * Return the modification time of a file in nanoseconds, so that a sidecar
+	 * isn't reused when its source is rewritten within the same second.
+	 */
+	int64_t mtimeNanos(const struct stat& st) {
+		return (int64_t) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
 	}
-	{
-		// Get the mid point of the list and create the bin trees using the mid values as root.
-		auto it = rows.begin();
-		std::advance(it, rows.size() / 2);
-		IMUGPSRow* tmp = *it;
-		m_gpsTimesT = new BinTree<long, IMUGPSRow*>(tmp->gpsTime, tmp);
-		m_utcTimesT = new BinTree<long, IMUGPSRow*>(tmp->utcTime, tmp);
-	}
-	// Iterate over the rows, adding to the trees. The root values will just update.
-	size_t i = 0;
+
+	template <class T>
+	bool readColumn(std::istream& in, std::vector<T>& col, size_t rows) {
+		col.resize(rows);
+		return (bool) in.read((char*) col.data(), rows * sizeof(T));
+	}
+
+	template <class T>
+	void writeColumn(std::ostream& out, const std::vector<T>& col) {
+		out.write((const char*) col.data(), col.size() * sizeof(T));
+	}
+
+} // anon
+
+IMUGPSReader::IMUGPSReader(const std::string& filename, double msOffset, bool cache) {
+	struct stat st;
+	bool haveStat = !stat(filename.c_str(), &st);
+	std::string cachePath = filename + ".bin";
+	if(!(cache && haveStat && loadCache(cachePath, st.st_size, mtimeNanos(st)))) {
+		load(filename);
+		if(cache && haveStat)
+			saveCache(cachePath, st.st_size, mtimeNanos(st));
+	}
+	// The offset is applied after caching so the cache is independent of it.
+	for(long& t : m_utcTime)
+		t = (long) (t + msOffset);
+
+	// Build the sorted time indexes.
+	size_t rows = m_gpsTime.size();
+	std::vector<std::pair<long, long>> byGps;
+	std::vector<std::pair<long, long>> byUtc;
+	byGps.reserve(rows);
+	byUtc.reserve(rows);
 	long mint = std::numeric_limits<long>::max(), maxt = std::numeric_limits<long>::lowest();
-	m_rows.resize(rows.size());
-	for(IMUGPSRow* row : rows) {
-		row->index = i++;
-		m_rows[row->index] = row;
-		m_gpsTimesT->add(row->gpsTime, row);
-		m_utcTimesT->add(row->utcTime, row);
-		if(row->utcTime < mint) mint = row->utcTime;
-		if(row->utcTime > maxt) maxt = row->utcTime;
+	for(size_t i = 0; i < rows; ++i) {
+		byGps.emplace_back(m_gpsTime[i], m_utcTime[i]);
+		byUtc.emplace_back(m_utcTime[i], m_gpsTime[i]);
+		if(m_utcTime[i] < mint) mint = m_utcTime[i];
+		if(m_utcTime[i] > maxt) maxt = m_utcTime[i];
 	}
+	buildIndex(byGps, m_gpsTimes, m_gpsUtc);
+	buildIndex(byUtc, m_utcTimes, m_utcGps);
 	std::cerr << "IMUGPS min date: " << mint << ", max date: " << maxt << "\n";
 }
 
-bool IMUGPSReader::getUTCTime(long gpsTime, long& utcTime) {
-	long gpsTime0;
-	IMUGPSRow* row;
-	if(m_gpsTimesT->findNearest(gpsTime, gpsTime0, row)) {
-		if(gpsTime == gpsTime0) {
-			utcTime = row->utcTime;
-			return true;
-		} else if(gpsTime > gpsTime0) {
-			if(row->index >= m_rows.size()) {
-				// Past the last row, return the last value.
-				utcTime = row->utcTime;
-			} else {
-				IMUGPSRow* row0 = m_rows[row->index];
-				IMUGPSRow* row1 = m_rows[row->index + 1];
-				// Interpolate the utc time, linearly.
-				utcTime = row0->utcTime + (row1->utcTime - row0->utcTime) * gpsTime / (row1->gpsTime - row0->gpsTime);
-			}
-			return true;
-		} else if(gpsTime < gpsTime0) {
-			if(row->index == 0) {
-				// At or before the first row, return the first value.
-				utcTime = row->utcTime;
-			} else {
-				IMUGPSRow* row0 = m_rows[row->index - 1];
-				IMUGPSRow* row1 = m_rows[row->index];
-				// Interpolate the utc time, linearly.
-				utcTime = row0->utcTime + (row1->utcTime - row0->utcTime) * gpsTime / (row1->gpsTime - row0->gpsTime);
-			}
-			return true;
+void IMUGPSReader::load(const std::string& filename) {
+	int fd = open(filename.c_str(), O_RDONLY);
+	if(fd < 0)
+		throw std::runtime_error("Failed to open IMU/GPS file " + filename + ": " + strerror(errno));
+	struct stat st;
+	fstat(fd, &st);
+	size_t size = st.st_size;
+	if(!size) {
+		::close(fd);
+		return;
+	}
+	void* mapped = mmap(0, size, PROT_READ, MAP_SHARED, fd, 0);
+	::close(fd);
+	if(mapped == MAP_FAILED)
+		throw std::runtime_error("Failed to map IMU/GPS file " + filename + ": " + strerror(errno));
+	const char* text = (const char*) mapped;
+	const char* end = text + size;
+	madvise(mapped, size, MADV_SEQUENTIAL);
+
+	// Skip the header.
+	const char* eol = (const char*) std::memchr(text, '\n', size);
+	if(!eol)
+		eol = end;
+
+	// Guess the row count from the length of the first data row.
+	if(eol < end) {
+		const char* next = (const char*) std::memchr(eol + 1, '\n', end - eol - 1);
+		size_t rows = size / ((next ? next : end) - eol);
+		for(auto* col : {&m_roll, &m_pitch, &m_yaw, &m_lat, &m_lon, &m_alt, &m_heading})
+			col->reserve(rows);
+		m_gpsTime.reserve(rows);
+		m_utcTime.reserve(rows);
+		m_status.reserve(rows);
+	}
+
+	// The columns are roll, pitch, yaw, lat, lon, alt, gps time, utc date, status, heading.
+	// Rows that don't parse are skipped.
+	constexpr int COLS = 10;
+	std::pair<const char*, const char*> f[COLS];
+	EpochCache dates;
+	double v[6];
+	double heading;
+	long gps, utc, status;
+	for(const char* p = eol + 1; p < end; p = eol + 1) {
+		eol = (const char*) std::memchr(p, '\n', end - p);
+		if(!eol)
+			eol = end;
+		int n = 0;
+		for(const char* a = p; n < COLS;) {
+			const char* t = (const char*) std::memchr(a, '\t', eol - a);
+			f[n++] = std::make_pair(a, t ? t : eol);
+			if(!t)
+				break;
+			a = t + 1;
 		}
+		if(n < COLS)
+			continue;
+		bool ok = true;
+		for(int i = 0; ok && i < 6; ++i)
+			ok = parseDouble(f[i].first, f[i].second, v[i]);
+		if(!ok || !parseLong(f[6].first, f[6].second, gps)
+				|| !dates.parse(f[7].first, f[7].second, utc)
+				|| !parseLong(f[8].first, f[8].second, status)
+				|| !parseDouble(f[9].first, f[9].second, heading))
+			continue;
+		m_roll.push_back(v[0]);
+		m_pitch.push_back(v[1]);
+		m_yaw.push_back(v[2]);
+		m_lat.push_back(v[3]);
+		m_lon.push_back(v[4]);
+		m_alt.push_back(v[5]);
+		m_gpsTime.push_back(gps);
+		m_utcTime.push_back(utc);
+		m_status.push_back((int) status);
+		m_heading.push_back(heading);
 	}
+	munmap(mapped, size);
+}
+
+bool IMUGPSReader::loadCache(const std::string& path, uint64_t fileSize, int64_t mtime) {
+	std::ifstream in(path, std::ios::in | std::ios::binary);
+	SidecarHeader hdr;
+	if(!in.read((char*) &hdr, sizeof(hdr))
+			|| !std::equal(IMUGPS_CACHE_MAGIC, IMUGPS_CACHE_MAGIC + sizeof(IMUGPS_CACHE_MAGIC), hdr.magic)
+			|| hdr.fileSize != fileSize || hdr.mtime != mtime || hdr.rows > fileSize)
+		return false;
+	size_t rows = hdr.rows;
+	if(readColumn(in, m_gpsTime, rows) && readColumn(in, m_utcTime, rows)
+			&& readColumn(in, m_roll, rows) && readColumn(in, m_pitch, rows) && readColumn(in, m_yaw, rows)
+			&& readColumn(in, m_lat, rows) && readColumn(in, m_lon, rows) && readColumn(in, m_alt, rows)
+			&& readColumn(in, m_status, rows) && readColumn(in, m_heading, rows))
+		return true;
+	for(auto* col : {&m_gpsTime, &m_utcTime})
+		col->clear();
+	for(auto* col : {&m_roll, &m_pitch, &m_yaw, &m_lat, &m_lon, &m_alt, &m_heading})
+		col->clear();
+	m_status.clear();
 	return false;
 }
 
-bool IMUGPSReader::getGPSTime(long utcTime, long& gpsTime) {
-	long utcTime0;
-	IMUGPSRow* row;
-	if(m_utcTimesT->findNearest(utcTime, utcTime0, row)) {
-		if(utcTime == utcTime0) {
-			gpsTime = row->gpsTime;
-			return true;
-		} else if(utcTime > utcTime0) {
-			if(row->index >= m_rows.size() - 1) {
-				gpsTime = row->gpsTime;
-			} else {
-				IMUGPSRow* row0 = m_rows[row->index];
-				IMUGPSRow* row1 = m_rows[row->index + 1];
-				gpsTime = row0->gpsTime + (row1->gpsTime - row0->gpsTime) * (utcTime - row0->utcTime) / (row1->utcTime - row0->utcTime);
-			}
-			return true;
-		} else if(utcTime < utcTime0) {
-			if(row->index == 0) {
-				gpsTime = row->gpsTime;
-			} else {
-				IMUGPSRow* row0 = m_rows[row->index - 1];
-				IMUGPSRow* row1 = m_rows[row->index];
-				gpsTime = row0->gpsTime + (row1->gpsTime - row0->gpsTime) * (utcTime - row0->utcTime) / (row1->utcTime - row0->utcTime);
-			}
-			return true;
+void IMUGPSReader::saveCache(const std::string& path, uint64_t fileSize, int64_t mtime) const {
+	SidecarHeader hdr;
+	std::copy(IMUGPS_CACHE_MAGIC, IMUGPS_CACHE_MAGIC + sizeof(IMUGPS_CACHE_MAGIC), hdr.magic);
+	hdr.fileSize = fileSize;
+	hdr.mtime = mtime;
+	hdr.rows = m_gpsTime.size();
+	// Write to a temporary file and rename so a partial cache is never read.
+	std::string tmp = path + ".tmp";
+	{
+		std::ofstream out(tmp, std::ios::out | std::ios::binary | std::ios::trunc);
+		out.write((const char*) &hdr, sizeof(hdr));
+		writeColumn(out, m_gpsTime);
+		writeColumn(out, m_utcTime);
+		writeColumn(out, m_roll);
+		writeColumn(out, m_pitch);
+		writeColumn(out, m_yaw);
+		writeColumn(out, m_lat);
+		writeColumn(out, m_lon);
+		writeColumn(out, m_alt);
+		writeColumn(out, m_status);
+		writeColumn(out, m_heading);
+		if(out.good())
+			out.close();
+		if(!out.good()) {
+			std::cerr << "Failed to write IMU/GPS cache " << tmp << "\n";
+			std::remove(tmp.c_str());
+			return;
 		}
 	}
-	return false;
+	if(std::rename(tmp.c_str(), path.c_str())) {
+		std::cerr << "Failed to write IMU/GPS cache " << path << ": " << strerror(errno) << "\n";
+		std::remove(tmp.c_str());
+	}
+}
+
+size_t IMUGPSReader::rows() const {
+	return m_gpsTime.size();
+}
+
+bool IMUGPSReader::getRow(size_t idx, IMUGPSRow& row) const {
+	if(idx >= m_gpsTime.size())
+		return false;
+	row.roll = m_roll[idx];
+	row.pitch = m_pitch[idx];
+	row.yaw = m_yaw[idx];
+	row.lat = m_lat[idx];
+	row.lon = m_lon[idx];
+	row.alt = m_alt[idx];
+	row.gpsTime = m_gpsTime[idx];
+	row.utcTime = m_utcTime[idx];
+	row.status = m_status[idx];
+	row.heading = m_heading[idx];
+	row.index = idx;
+	return true;
+}
+
+bool IMUGPSReader::getUTCTime(long gpsTime, long& utcTime) {
+	if(m_gpsTimes.empty())
+		return false;
+	size_t i = lowerBound(m_gpsTimes.data(), m_gpsTimes.size(), gpsTime);
+	utcTime = interpolate(m_gpsTimes, m_gpsUtc, gpsTime, i);
+	return true;
+}
+
+bool IMUGPSReader::getGPSTime(long utcTime, long& gpsTime) {
+	if(m_utcTimes.empty())
+		return false;
+	size_t i = lowerBound(m_utcTimes.data(), m_utcTimes.size(), utcTime);
+	gpsTime = interpolate(m_utcTimes, m_utcGps, utcTime, i);
+	return true;
+}
+
+bool IMUGPSReader::getGPSTimes(const std::vector<long>& utcTimes, std::vector<long>& gpsTimes, int threads) const {
+	if(m_utcTimes.empty())
+		return false;
+	gpsTimes.resize(utcTimes.size());
+	parallelChunks(utcTimes.size(), threads, [&](size_t start, size_t end) {
+		Cursor cur(*this);
+		for(size_t i = start; i < end; ++i)
+			cur.getGPSTime(utcTimes[i], gpsTimes[i]);
+	});
+	return true;
+}
+
+IMUGPSReader::Cursor IMUGPSReader::cursor() const {
+	return Cursor(*this);
+}
+
+IMUGPSReader::Cursor::Cursor(const IMUGPSReader& reader) :
+	m_reader(&reader),
+	m_gpsPos(0),
+	m_utcPos(0) {
+}
+
+bool IMUGPSReader::Cursor::getUTCTime(long gpsTime, long& utcTime) {
+	const std::vector<long>& times = m_reader->m_gpsTimes;
+	if(times.empty())
+		return false;
+	m_gpsPos = gallopLowerBound(times.data(), times.size(), gpsTime, m_gpsPos);
+	utcTime = interpolate(times, m_reader->m_gpsUtc, gpsTime, m_gpsPos);
+	return true;
 }
 
-IMUGPSReader::~IMUGPSReader() {
-	delete m_gpsTimesT;
-	delete m_utcTimesT;
+bool IMUGPSReader::Cursor::getGPSTime(long utcTime, long& gpsTime) {
+	const std::vector<long>& times = m_reader->m_utcTimes;
+	if(times.empty())
+		return false;
+	m_utcPos = gallopLowerBound(times.data(), times.size(), utcTime, m_utcPos);
+	gpsTime = interpolate(times, m_reader->m_utcGps, utcTime, m_utcPos);
+	return true;
 }
 
+namespace {
+
+	constexpr char FLAME_INDEX_MAGIC[8] = {'H', 'L', 'R', 'G', 'F', 'I', 'X', '1'};
+
+	/**
+	 * Parse a Flame date, using the fixed-format parser and falling back
+	 * to getUTCMilSec for anything it doesn't recognize.
+	 */
+	long parseFlameDate(const char* a, const char* b) {
+		long ms;
+		if(parseDateTime(a, b, ms))
+			return ms;
+		return getUTCMilSec(std::string(a, b), "%Y-%m-%d %H:%M:%S");
+	}
+
+	/**
+	 * Return the end of the line starting at p; the newline or end.
+	 */
+	const char* lineEnd(const char* p, const char* end) {
+		const char* e = (const char*) std::memchr(p, '\n', end - p);
+		return e ? e : end;
+	}
+
+} // anon
+
 bool FlameRow::read(std::istream& in, double msOffset) {
 	std::string buf;
-	if(!std::getline(in, buf, ','))
+	if(!std::getline(in, buf, '\n'))
 		return false;
-	dateTime = getUTCMilSec(buf, "%Y-%m-%d %H:%M:%S") + msOffset;
-	if(!std::getline(in, buf, ','))
+	return parse(buf.data(), buf.data() + buf.size(), msOffset);
+}
+
+bool FlameRow::parse(const char* a, const char* b, double msOffset) {
+	if(b > a && *(b - 1) == '\r')
+		--b;
+	const char* p = (const char*) std::memchr(a, ',', b - a);
+	if(!p)
 		return false;
-	utcTime = std::stol(buf);
-	if(!std::getline(in, buf, '\n'))
+	dateTime = parseFlameDate(a, p) + msOffset;
+	a = p + 1;
+	if(!(p = (const char*) std::memchr(a, ',', b - a)))
+		return false;
+	long t;
+	if(!parseLong(a, p, t))
 		return false;
+	utcTime = t;
+	a = p + 1;
 	size_t i = 0;
-	std::stringstream cols(buf);
-	while(std::getline(cols, buf, ','))
-		bands[i++] = std::stod(buf);
-	return in.good();
+	while(a < b && i < bands.size()) {
+		if(!(p = (const char*) std::memchr(a, ',', b - a)))
+			p = b;
+		bands[i++] = parseDouble(a, p);
+		a = p + 1;
+	}
+	return true;
 }
 
-FlameReader::FlameReader(const std::string& filename, double msOffset) :
+FlameReader::FlameReader(const std::string& filename, double msOffset, bool persistIndex) :
 	m_msOffset(msOffset),
-	m_filename(filename) {
-	m_in.open(filename, std::ios::in);
-	std::string buf;
-	std::getline(m_in, buf, ',');
-	std::getline(m_in, buf, ',');
-	std::getline(m_in, buf, '\n');
-	std::stringstream cols(buf);
-	while(std::getline(cols, buf, ','))
-		wavelengths.push_back(std::stod(buf));
+	m_filename(filename),
+	m_rowIdx(0),
+	m_mapped(nullptr), m_mappedSize(0),
+	m_recordCount(0), m_recordSize(0),
+	m_text(nullptr), m_textSize(0) {
+	if(slog::isSpectralLog(filename)) {
+		loadLog();
+	} else {
+		loadText(persistIndex);
+	}
+}
+
+FlameReader::FlameReader(double msOffset) :
+	m_msOffset(msOffset),
+	m_rowIdx(0),
+	m_mapped(nullptr), m_mappedSize(0),
+	m_recordCount(0), m_recordSize(0),
+	m_text(nullptr), m_textSize(0) {
+}
+
+void FlameReader::loadLog() {
+	int fd = open(m_filename.c_str(), O_RDONLY);
+	if(fd < 0)
+		throw std::runtime_error("Failed to open spectral log " + m_filename + ": " + strerror(errno));
+	struct stat st;
+	fstat(fd, &st);
+	m_mappedSize = st.st_size;
+	if(m_mappedSize < sizeof(slog::Header)) {
+		::close(fd);
+		throw std::runtime_error("Invalid spectral log: " + m_filename);
+	}
+	void* mapped = mmap(0, m_mappedSize, PROT_READ, MAP_SHARED, fd, 0);
+	::close(fd);
+	if(mapped == MAP_FAILED)
+		throw std::runtime_error("Failed to map spectral log " + m_filename + ": " + strerror(errno));
+
+	// This runs from the constructor, so the destructor won't release the mapping if the header is bad.
+	slog::Header hdr;
+	std::memcpy(&hdr, mapped, sizeof(hdr));
+	if(hdr.version != slog::VERSION || m_mappedSize < slog::dataOffset(hdr.bands)) {
+		munmap(mapped, m_mappedSize);
+		m_mappedSize = 0;
+		throw std::runtime_error("Unsupported spectral log: " + m_filename);
+	}
+	m_mapped = (char*) mapped;
+	units.assign(hdr.units, strnlen(hdr.units, sizeof(hdr.units)));
+	wavelengths.resize(hdr.bands);
+	std::memcpy(wavelengths.data(), m_mapped + sizeof(hdr), hdr.bands * sizeof(double));
+	m_recordSize = slog::recordSize(hdr.bands);
+	// Trust the file size over the header, in case the writer didn't finish.
+	m_recordCount = std::min((size_t) hdr.records, (m_mappedSize - slog::dataOffset(hdr.bands)) / m_recordSize);
+}
+
+void FlameReader::loadText(bool persistIndex) {
+	int fd = open(m_filename.c_str(), O_RDONLY);
+	if(fd < 0)
+		throw std::runtime_error("Failed to open Flame file " + m_filename + ": " + strerror(errno));
+	struct stat st;
+	fstat(fd, &st);
+	m_textSize = st.st_size;
+	if(!m_textSize) {
+		::close(fd);
+		return;
+	}
+	void* mapped = mmap(0, m_textSize, PROT_READ, MAP_SHARED, fd, 0);
+	::close(fd);
+	if(mapped == MAP_FAILED)
+		throw std::runtime_error("Failed to map Flame file " + m_filename + ": " + strerror(errno));
+	m_text = (char*) mapped;
+	madvise(m_text, m_textSize, MADV_SEQUENTIAL);
+
+	// The header is date,timestamp,[wl1],[wl2],...
+	const char* end = m_text + m_textSize;
+	const char* eol = lineEnd(m_text, end);
+	std::string header((const char*) m_text, eol);
+	std::vector<std::pair<const char*, const char*>> fields;
+	splitFields(header, fields);
+	for(size_t i = 2; i < fields.size(); ++i)
+		wavelengths.push_back(parseDouble(fields[i].first, fields[i].second));
+
+	std::string indexPath = m_filename + ".idx";
+	if(persistIndex && loadIndex(indexPath, st.st_size, mtimeNanos(st)))
+		return;
+
+	// Record the offset and timestamp of each row. Blank or malformed lines are skipped.
+	m_offsets.reserve(m_textSize / (eol - m_text + 1));
+	m_times.reserve(m_offsets.capacity());
+	for(const char* p = eol + 1; p < end; p = eol + 1) {
+		eol = lineEnd(p, end);
+		const char* c1 = (const char*) std::memchr(p, ',', eol - p);
+		if(!c1)
+			continue;
+		const char* c2 = (const char*) std::memchr(c1 + 1, ',', eol - c1 - 1);
+		long t;
+		if(!c2 || !parseLong(c1 + 1, c2, t))
+			continue;
+		m_offsets.push_back(p - m_text);
+		m_times.push_back(t);
+	}
+
+	if(persistIndex)
+		saveIndex(indexPath, st.st_size, mtimeNanos(st));
+}
+
+bool FlameReader::loadIndex(const std::string& path, uint64_t fileSize, int64_t mtime) {
+	std::ifstream in(path, std::ios::in | std::ios::binary);
+	SidecarHeader hdr;
+	if(!in.read((char*) &hdr, sizeof(hdr))
+			|| !std::equal(FLAME_INDEX_MAGIC, FLAME_INDEX_MAGIC + sizeof(FLAME_INDEX_MAGIC), hdr.magic)
+			|| hdr.fileSize != fileSize || hdr.mtime != mtime || hdr.rows > fileSize)
+		return false;
+	std::vector<uint64_t> offsets(hdr.rows);
+	std::vector<int64_t> times(hdr.rows);
+	if(!in.read((char*) offsets.data(), hdr.rows * sizeof(uint64_t))
+			|| !in.read((char*) times.data(), hdr.rows * sizeof(int64_t)))
+		return false;
+	for(uint64_t offset : offsets) {
+		if(offset >= fileSize)
+			return false;
+	}
+	m_offsets.swap(offsets);
+	m_times.swap(times);
+	return true;
+}
+
+void FlameReader::saveIndex(const std::string& path, uint64_t fileSize, int64_t mtime) const {
+	SidecarHeader hdr;
+	std::copy(FLAME_INDEX_MAGIC, FLAME_INDEX_MAGIC + sizeof(FLAME_INDEX_MAGIC), hdr.magic);
+	hdr.fileSize = fileSize;
+	hdr.mtime = mtime;
+	hdr.rows = m_offsets.size();
+	// Write to a temporary file and rename so a partial index is never read.
+	std::string tmp = path + ".tmp";
+	{
+		std::ofstream out(tmp, std::ios::out | std::ios::binary | std::ios::trunc);
+		out.write((const char*) &hdr, sizeof(hdr));
+		out.write((const char*) m_offsets.data(), m_offsets.size() * sizeof(uint64_t));
+		out.write((const char*) m_times.data(), m_times.size() * sizeof(int64_t));
+		if(out.good())
+			out.close();
+		if(!out.good()) {
+			std::cerr << "Failed to write Flame index " << tmp << "\n";
+			std::remove(tmp.c_str());
+			return;
+		}
+	}
+	if(std::rename(tmp.c_str(), path.c_str())) {
+		std::cerr << "Failed to write Flame index " << path << ": " << strerror(errno) << "\n";
+		std::remove(tmp.c_str());
+	}
+}
+
+long FlameReader::logTime(size_t idx) const {
+	int64_t t;
+	std::memcpy(&t, m_mapped + slog::dataOffset(wavelengths.size()) + idx * m_recordSize + sizeof(int64_t), sizeof(t));
+	return t;
+}
+
+void FlameReader::add(const std::string& date, long utcTime, const std::vector<double>& bands) {
+	FlameRow& row = m_rows.emplace_back();
+	row.dateTime = date.empty() ? 0 : parseFlameDate(date.data(), date.data() + date.size()) + m_msOffset;
+	row.utcTime = utcTime;
+	row.bands.assign(bands.begin(), bands.end());
 }
 
 int FlameReader::rows() {
-	std::ifstream in(m_filename, std::ios::in);
-	std::string buf;
-	int count = 0;
-	while(std::getline(in, buf, '\n'))
-		++count;
-	return count - 1; // -1 for the header row.
+	if(m_mapped)
+		return (int) m_recordCount;
+	if(m_filename.empty())
+		return (int) m_rows.size();
+	return (int) m_offsets.size();
 }
 
-bool FlameReader::next(FlameRow& row) {
+bool FlameReader::seek(long utcTime) {
+	size_t lo = 0, hi;
+	if(m_mapped) {
+		hi = m_recordCount;
+		while(lo < hi) {
+			size_t mid = lo + (hi - lo) / 2;
+			if(logTime(mid) < utcTime) {
+				lo = mid + 1;
+			} else {
+				hi = mid;
+			}
+		}
+		m_rowIdx = lo;
+		return lo < m_recordCount;
+	} else if(m_filename.empty()) {
+		auto it = std::lower_bound(m_rows.begin(), m_rows.end(), utcTime,
+				[](const FlameRow& r, long t) { return r.utcTime < t; });
+		m_rowIdx = std::distance(m_rows.begin(), it);
+		return it != m_rows.end();
+	} else {
+		auto it = std::lower_bound(m_times.begin(), m_times.end(), utcTime);
+		m_rowIdx = std::distance(m_times.begin(), it);
+		return it != m_times.end();
+	}
+}
+
+bool FlameReader::read(size_t idx, FlameRow& row) {
 	if(row.wavelengths.empty()) {
 		row.wavelengths.assign(wavelengths.begin(), wavelengths.end());
 		row.bands.resize(row.wavelengths.size());
 	}
-	return row.read(m_in, m_msOffset);
+	if(m_mapped) {
+		if(idx >= m_recordCount)
+			return false;
+		const char* rec = m_mapped + slog::dataOffset(wavelengths.size()) + idx * m_recordSize;
+		int64_t t[2];
+		std::memcpy(t, rec, sizeof(t));
+		row.dateTime = t[0] + m_msOffset;
+		row.utcTime = t[1];
+		const char* values = rec + sizeof(t);
+		float v;
+		for(size_t i = 0; i < row.bands.size(); ++i) {
+			std::memcpy(&v, values + i * sizeof(float), sizeof(float));
+			row.bands[i] = v;
+		}
+		return true;
+	} else if(m_filename.empty()) {
+		if(idx >= m_rows.size())
+			return false;
+		const FlameRow& r = m_rows[idx];
+		row.dateTime = r.dateTime;
+		row.utcTime = r.utcTime;
+		std::copy(r.bands.begin(), r.bands.end(), row.bands.begin());
+		return true;
+	}
+	if(idx >= m_offsets.size())
+		return false;
+	const char* end = m_text + m_textSize;
+	const char* p = m_text + m_offsets[idx];
+	return row.parse(p, lineEnd(p, end), m_msOffset);
+}
+
+bool FlameReader::next(FlameRow& row) {
+	if(!read(m_rowIdx, row))
+		return false;
+	++m_rowIdx;
+	return true;
+}
+
+FlameReader::~FlameReader() {
+	if(m_mapped)
+		munmap(m_mapped, m_mappedSize);
+	if(m_text)
+		munmap(m_text, m_textSize);
 }
 
 
 CSVReader::CSVReader(const std::string& filename, bool transpose, int headerRows, int minWlCol, int maxWlCol, int idCol) :
+	m_width(0),
 	m_filename(filename),
 	m_idx(0),
 	m_transpose(transpose),
@@ -1035,30 +3480,68 @@ CSVReader::CSVReader(const std::string& filename, bool transpose, int headerRows
 }
 
 void CSVReader::load() {
-	m_data.clear();
+	m_values.clear();
+	m_ids.clear();
+	m_header.clear();
+	m_width = std::max(0, m_maxWlCol - m_minWlCol + 1);
+
+	size_t hIdx = m_headerRows > 0 ? m_headerRows - 1 : 0;
 	std::ifstream input(m_filename);
-	m_cols = 1;
-	m_rows = 0;
-	int maxCols = 0;
 	std::string line;
-	while(std::getline(input, line)) {
-		if(line.empty())
-			continue;
-		std::vector<std::string> row;
-		std::string field;
-		std::stringstream ss(line);
-		while(std::getline(ss, field, ','))
-			row.push_back(field);
-		m_data.push_back(row);
-		++m_rows;
-		maxCols = std::max(maxCols, (int) row.size());
-	}
+	std::vector<std::pair<const char*, const char*>> fields;
 
-	for(std::vector<std::string>& row : m_data)
-		row.resize(maxCols);
+	if(!m_transpose) {
+		// Each line is a record. Values go straight into the matrix.
+		size_t row = 0;
+		while(std::getline(input, line)) {
+			if(line.empty())
+				continue;
+			splitFields(line, fields);
+			if(row == hIdx) {
+				for(int c = m_minWlCol; c <= m_maxWlCol; ++c)
+					m_header.push_back(c < (int) fields.size() ? parseDouble(fields[c].first, fields[c].second) : 0);
+			}
+			if((int) row >= m_headerRows) {
+				for(int c = m_minWlCol; c <= m_maxWlCol; ++c)
+					m_values.push_back(c < (int) fields.size() ? parseDouble(fields[c].first, fields[c].second) : 0);
+				if(m_idCol >= 0)
+					m_ids.emplace_back(m_idCol < (int) fields.size() ? std::string(fields[m_idCol].first, fields[m_idCol].second) : "");
+			}
+			++row;
+		}
+	} else {
+		// Each column is a record, and each line is a band (or the header, or the ids).
+		// Collect the band lines band-major, then transpose.
+		std::vector<double> bandMajor;
+		size_t records = 0;
+		int row = 0;
+		while(std::getline(input, line)) {
+			if(line.empty())
+				continue;
+			splitFields(line, fields);
+			if(records == 0)
+				records = fields.size() > (size_t) m_headerRows ? fields.size() - m_headerRows : 0;
+			if(row >= m_minWlCol && row <= m_maxWlCol) {
+				m_header.push_back(hIdx < fields.size() ? parseDouble(fields[hIdx].first, fields[hIdx].second) : 0);
+				for(size_t i = 0; i < records; ++i) {
+					size_t c = m_headerRows + i;
+					bandMajor.push_back(c < fields.size() ? parseDouble(fields[c].first, fields[c].second) : 0);
+				}
+			}
+			if(row == m_idCol) {
+				for(size_t i = 0; i < records; ++i) {
+					size_t c = m_headerRows + i;
+					m_ids.emplace_back(c < fields.size() ? std::string(fields[c].first, fields[c].second) : "");
+				}
+			}
+			++row;
+		}
+		m_values.resize(bandMajor.size());
+		blockedTranspose(bandMajor.data(), m_values.data(), m_header.size(), records);
+	}
 
-	if(m_transpose)
-		transpose();
+	m_cols = 1;
+	m_rows = m_headerRows + (m_width > 0 ? (int) (m_values.size() / m_width) : 0);
 
 	loadBandMap();
 	reset();
@@ -1066,16 +3549,9 @@ void CSVReader::load() {
 
 void CSVReader::loadBandMap() {
 	std::map<int, int> map;
-	size_t hIdx = m_headerRows > 0 ? m_headerRows - 1 : 0;
-	if(m_data.size() > hIdx) {
-		const std::vector<std::string>& header = m_data[hIdx];
-		if(m_minWlCol >= 0 && m_maxWlCol < (int) header.size()) {
-			for(int i = m_minWlCol; i <= m_maxWlCol; ++i) {
-				double wl = atof(header[i].c_str());
-				int idx = (int) (wl * WL_SCALE);
-				map[idx] = i;
-			}
-		}
+	for(size_t i = 0; i < m_header.size(); ++i) {
+		int idx = (int) (m_header[i] * WL_SCALE);
+		map[idx] = m_minWlCol + i;
 	}
 	setBandMap(map);
 }
@@ -1084,17 +3560,11 @@ void CSVReader::reset() {
 	m_idx = m_headerRows;
 }
 
-void CSVReader::transpose() {
-	std::vector<std::vector<std::string> > tmp(m_cols);
-	for(int c = 0; c < m_cols; ++c)
-		tmp[c].resize(m_rows);
-	for(int r = 0; r < m_rows; ++r) {
-		for(int c = 0; c < m_cols; ++c)
-			tmp[c][r] = m_data[r][c];
-	}
-	m_data.swap(tmp);
-	m_cols = m_rows;
-	m_rows = m_data.size();
+void CSVReader::bandSpan(int& first, int& count) const {
+	// The band indices are column indices; the matrix starts at the first wavelength column.
+	first = std::max(0, m_minIdx - m_minWlCol);
+	int last = std::min(m_width - 1, m_maxIdx - m_minWlCol);
+	count = std::max(0, last - first + 1);
 }
 
 bool CSVReader::next(std::string& id, std::vector<double>& buf, int& cols, int& col, int& row) {
@@ -1105,18 +3575,46 @@ bool CSVReader::next(std::string& id, std::vector<double>& buf, int& cols, int&
 	col = 0;
 	row = m_idx;
 
-	std::vector<double> data(m_maxIdx - m_minIdx + 1);
-	for(int i = m_minIdx; i <= m_maxIdx; ++i)
-		data[i - m_minIdx] = atof(m_data[m_idx][i].c_str());
-	buf.assign(data.begin(), data.end());
+	int first, bands;
+	bandSpan(first, bands);
+	const double* rec = m_values.data() + (size_t) (m_idx - m_headerRows) * m_width + first;
+	buf.assign(rec, rec + bands);
 
-	id = m_data[m_idx][m_idCol];
+	id = m_ids.empty() ? "" : m_ids[m_idx - m_headerRows];
 
 	++m_idx;
 
 	return true;
 }
 
+bool CSVReader::nextBlock(SpectralBlock& block, size_t maxCount) {
+	if(m_idx >= m_rows)
+		return false;
+	int offset, bands;
+	bandSpan(offset, bands);
+	size_t count = std::min((size_t) (m_rows - m_idx), maxCount ? maxCount : (size_t) m_bufSize);
+	size_t first = m_idx - m_headerRows;
+	if(bands == m_width) {
+		// The whole record is wanted, so the block is a view of the matrix.
+		block.resize(count, bands, false);
+		block.data = m_values.data() + first * m_width;
+	} else {
+		block.resize(count, bands);
+		for(size_t i = 0; i < count; ++i) {
+			const double* rec = m_values.data() + (first + i) * m_width + offset;
+			std::copy(rec, rec + bands, block.buf.data() + i * bands);
+		}
+	}
+	if(!m_ids.empty())
+		block.ids.assign(m_ids.begin() + first, m_ids.begin() + first + count);
+	for(size_t i = 0; i < count; ++i) {
+		block.cols[i] = 0;
+		block.rows[i] = m_idx + i;
+	}
+	m_idx += count;
+	return true;
+}
+
 
 void CSVReader::guessFileProperties(const std::string& filename, bool& transpose, int& header, int& minCol, int& maxCol, int& idCol) {
 
@@ -1204,3 +3702,183 @@ void CSVReader::guessFileProperties(const std::string& filename, bool& transpose
 	while(maxCol > minCol && !headerisfloat[maxCol])
 		--maxCol;
 }
+
+
+PrefetchReader::PrefetchReader(std::unique_ptr<Reader> reader, size_t depth) : Reader(),
+	m_reader(std::move(reader)),
+	m_depth(std::max((size_t) 1, depth)),
+	m_mode(Mode::None),
+	m_maxCount(0),
+	m_filled(0), m_taken(0),
+	m_done(false),
+	m_stop(false) {
+
+	if(!m_reader)
+		throw std::invalid_argument("A reader is required.");
+	sync();
+}
+
+Reader* PrefetchReader::reader() const {
+	return m_reader.get();
+}
+
+void PrefetchReader::sync() {
+	// The base holds only plain values, so the wrapped reader's can be copied wholesale.
+	Reader::operator=(*m_reader);
+}
+
+void PrefetchReader::setBufSize(int bufSize) {
+	stop();
+	m_reader->setBufSize(bufSize);
+	sync();
+}
+
+void PrefetchReader::setBandMap(const std::map<int, int>& map) {
+	stop();
+	m_reader->setBandMap(map);
+	sync();
+}
+
+void PrefetchReader::setBandRange(double min, double max) {
+	stop();
+	m_reader->setBandRange(min, max);
+	sync();
+}
+
+void PrefetchReader::setBands(const std::vector<int>& bands) {
+	stop();
+	m_reader->setBands(bands);
+	sync();
+}
+
+void PrefetchReader::start(Mode mode) {
+	if(m_mode != Mode::None)
+		throw std::runtime_error("next and nextBlock can't be mixed on a PrefetchReader.");
+	sync();
+	m_mode = mode;
+	m_ring.resize(m_depth);
+	m_filled = m_taken = 0;
+	m_done = false;
+	m_stop = false;
+	m_error = nullptr;
+	m_thread.reset(new std::thread(&PrefetchReader::run, this));
+}
+
+void PrefetchReader::stop() {
+	if(m_thread) {
+		{
+			std::lock_guard<std::mutex> lk(m_mtx);
+			m_stop = true;
+		}
+		m_cv.notify_all();
+		m_thread->join();
+		m_thread.reset();
+	}
+	m_mode = Mode::None;
+}
+
+void PrefetchReader::run() {
+	while(true) {
+		size_t slot;
+		{
+			// Wait for the consumer to free a slot.
+			std::unique_lock<std::mutex> lk(m_mtx);
+			m_cv.wait(lk, [&]{ return m_stop || m_filled - m_taken < m_depth; });
+			if(m_stop)
+				return;
+			slot = m_filled % m_depth;
+		}
+		// The consumer doesn't touch a free slot, so it can be filled without the lock.
+		Item& item = m_ring[slot];
+		bool ok;
+		try {
+			if(m_mode == Mode::NextBlock) {
+				ok = m_reader->nextBlock(item.block, m_maxCount);
+				// Copy spectra that are a view of the wrapped reader's memory.
+				if(ok && item.block.data != item.block.buf.data()) {
+					item.block.buf.assign(item.block.data, item.block.data + item.block.count * item.block.bands);
+					item.block.data = item.block.buf.data();
+				}
+			} else {
+				ok = m_reader->next(item.id, item.block.buf, item.cols, item.col, item.row);
+			}
+			item.ok = ok;
+		} catch(...) {
+			{
+				std::lock_guard<std::mutex> lk(m_mtx);
+				m_error = std::current_exception();
+				m_done = true;
+			}
+			m_cv.notify_all();
+			return;
+		}
+		{
+			std::lock_guard<std::mutex> lk(m_mtx);
+			++m_filled;
+			m_done = !ok;
+		}
+		m_cv.notify_all();
+		if(!ok)
+			return;
+	}
+}
+
+int PrefetchReader::take(std::unique_lock<std::mutex>& lk) {
+	m_cv.wait(lk, [&]{ return m_taken < m_filled || m_done; });
+	if(m_taken < m_filled)
+		return (int) (m_taken % m_depth);
+	if(m_error) {
+		// Report the failure once.
+		std::exception_ptr ex = m_error;
+		m_error = nullptr;
+		std::rethrow_exception(ex);
+	}
+	return -1;
+}
+
+bool PrefetchReader::next(std::string& id, std::vector<double>& buf, int& cols, int& col, int& row) {
+	if(m_mode != Mode::Next)
+		start(Mode::Next);
+	bool ok;
+	{
+		std::unique_lock<std::mutex> lk(m_mtx);
+		int slot = take(lk);
+		if(slot < 0)
+			return false;
+		// Hand the caller the item and give the ring the caller's buffers.
+		Item& item = m_ring[slot];
+		id.swap(item.id);
+		buf.swap(item.block.buf);
+		cols = item.cols;
+		col = item.col;
+		row = item.row;
+		ok = item.ok;
+		++m_taken;
+	}
+	m_cv.notify_all();
+	return ok;
+}
+
+bool PrefetchReader::nextBlock(SpectralBlock& block, size_t maxCount) {
+	if(m_mode != Mode::NextBlock) {
+		m_maxCount = maxCount;
+		start(Mode::NextBlock);
+	}
+	bool ok;
+	{
+		std::unique_lock<std::mutex> lk(m_mtx);
+		int slot = take(lk);
+		if(slot < 0)
+			return false;
+		Item& item = m_ring[slot];
+		std::swap(block, item.block);
+		ok = item.ok;
+		++m_taken;
+	}
+	m_cv.notify_all();
+	return ok;
+}
+
+PrefetchReader::~PrefetchReader() {
+	stop();
+}
@@ -18,11 +18,13 @@
 #include <QtWidgets/QMessageBox>
 
 #include "reader.hpp"
+#include "convolve.hpp"
 #include "grid.hpp"
 #include "ui/reflectance_ui.hpp"
 
 using namespace hlrg::reflectance;
 using namespace hlrg::reader;
+using namespace hlrg::convolve;
 
 namespace {
 
@@ -61,6 +63,23 @@ namespace {
 		~DummyListener() {}
 	};
 
+	/**
+	 * Receives updates from the in-memory convolution of the irradiance spectra.
+	 */
+	class DummyConvolveListener : public ConvolveListener {
+	public:
+		void started(Convolve*) {
+			std::cout << "Convolving irradiance ";
+		}
+		void update(Convolve*) {}
+		void stopped(Convolve*) {
+			std::cout << " Stopped.\n";
+		}
+		void finished(Convolve*) {
+			std::cout << " Done.\n";
+		}
+	};
+
 }
 
 
@@ -70,7 +89,18 @@ void Reflectance::run(ReflectanceListener& listener,
 		const std::string& frameIdx,
 		const std::string& irradConv, double irradUTCOffset,
 		const std::string& reflOut,
-		bool& running) {
+		bool& running, bool imuCache, bool persistIndex) {
+	FlameReader fr(irradConv, irradUTCOffset * 3600000, persistIndex);
+	run(listener, imuGps, imuUTCOffset, rawRad, frameIdx, fr, reflOut, running, imuCache);
+}
+
+void Reflectance::run(ReflectanceListener& listener,
+		const std::string& imuGps, double imuUTCOffset,
+		const std::string& rawRad,
+		const std::string& frameIdx,
+		FlameReader& fr,
+		const std::string& reflOut,
+		bool& running, bool imuCache) {
 
 	// Proposed algorithm: Since the flame is the largest dataset, we iterate over the rows, using the frame index
 	// from the nano to locate the row offset for the corresponding time. Probably should use a b-tree for searching. -- done
@@ -93,14 +123,7 @@ void Reflectance::run(ReflectanceListener& listener,
 		return;
 	}
 
-	IMUGPSReader ir(imuGps, imuUTCOffset * 3600000);
-
-	if(!running) {
-		listener.stopped(this);
-		return;
-	}
-
-	FlameReader fr(irradConv, irradUTCOffset * 3600000);
+	IMUGPSReader ir(imuGps, imuUTCOffset * 3600000, imuCache);
 
 	if(!running) {
 		listener.stopped(this);
@@ -144,6 +167,11 @@ void Reflectance::run(ReflectanceListener& listener,
 	int firstIdx;
 	fi.getNearestFrame(0, actualGpsTime0, firstIdx);
 
+	// The flame times increase monotonically, so the lookups use cursors that
+	// advance from the previous position.
+	FrameIndexReader::Cursor fiCur = fi.cursor();
+	IMUGPSReader::Cursor irCur = ir.cursor();
+
 	if(!running) {
 		listener.stopped(this);
 		return;
@@ -156,8 +184,8 @@ void Reflectance::run(ReflectanceListener& listener,
 	if(running && fr.next(frow0)) {
 
 		// Get the nearest frame and times for the flame's time.
-		ir.getGPSTime(frow0.utcTime, gpsTime);
-		fi.getNearestFrame(gpsTime, actualGpsTime0, frame0);
+		irCur.getGPSTime(frow0.utcTime, gpsTime);
+		fiCur.getNearestFrame(gpsTime, actualGpsTime0, frame0);
 
 		if(!running) {
 			listener.stopped(this);
@@ -173,8 +201,8 @@ void Reflectance::run(ReflectanceListener& listener,
 			}
 
 			// Get the nearest frame and times for the flame's time.
-			ir.getGPSTime(frow1.utcTime, gpsTime);
-			fi.getNearestFrame(gpsTime, actualGpsTime1, frame1);
+			irCur.getGPSTime(frow1.utcTime, gpsTime);
+			fiCur.getNearestFrame(gpsTime, actualGpsTime1, frame1);
 
 			// If the frame has advanced...
 			if(running && frame1 > frame0) {
@@ -264,10 +292,24 @@ void usage() {
 	std::cout << "Usage: reflectance [<options>]\n"
 			<< " -i 	The IMUGPS file.\n"
 			<< " -io 	Time offset to convert IMUGPS time to UTC. (Default 0).\n"
+			<< " -ic 	Cache the parsed IMUGPS table in a binary file (<imugps>.bin) for later runs.\n"
 			<< " -r 	The raw radiance file (raster).\n"
 			<< " -f 	The frame index file.\n"
 			<< " -c		Convolved irradiance file.\n"
 			<< " -co	Time offset to convert convolved time to UTC. (Default 0).\n"
+			<< " -ci	Keep the row index of the convolved irradiance in a sidecar file (<file>.idx)\n"
+			<< "    	for later runs. Ignored with -cb.\n"
+			<< " -cb	A convolve band definition file. If given, the -c file is the raw irradiance\n"
+			<< "    	(date, timestamp, bands...) and is convolved in memory before use.\n"
+			<< " -cbd	The delimiter for the band definition file. (Default ',').\n"
+			<< " -cs	Scale the raw irradiance by this amount before convolution. (Default 1).\n"
+			<< " -cf	Shift the raw irradiance wavelengths by this amount before convolution. (Default 0).\n"
+			<< " -ct	The convolution threshold -- the gaussian will extend out until it is below this value. (Default 0.0001).\n"
+			<< " -cds	The delimiter for the raw irradiance file. (Default ',').\n"
+			<< " -cfr	First data row index of the raw irradiance (zero-based). (Default 0).\n"
+			<< " -cfc	First data column index of the raw irradiance (zero-based). (Default 2).\n"
+			<< " -cdc	Date column index of the raw irradiance (zero-based). (Default 0).\n"
+			<< " -ctc	Timestamp column index of the raw irradiance (zero-based). (Default 1).\n"
 			<< " -o 	Reflectance output file.\n";
 }
 
@@ -286,6 +328,18 @@ int main(int argc, char** argv) {
 		std::string frameIdx;
 		std::string irradConv;
 		std::string reflOut;
+		std::string bandDef;
+		std::string bandDefDelim = ",";
+		double irradScale = 1;
+		double irradShift = 0;
+		double irradThreshold = 0.0001;
+		std::string irradDelim = ",";
+		int irradFirstRow = 0;
+		int irradFirstCol = 2;
+		int irradDateCol = 0;
+		int irradTimeCol = 1;
+		bool imuCache = false;
+		bool persistIndex = false;
 
 		for(int i = 1; i < argc; ++i) {
 			std::string arg(argv[i]);
@@ -293,6 +347,8 @@ int main(int argc, char** argv) {
 				imuGps = argv[++i];
 			} else if(arg == "-io") {
 				imuUTCOffset = atof(argv[++i]);
+			} else if(arg == "-ic") {
+				imuCache = true;
 			} else if(arg == "-r") {
 				rawRad = argv[++i];
 			} else if(arg == "-f") {
@@ -303,6 +359,28 @@ int main(int argc, char** argv) {
 				reflOut = argv[++i];
 			} else if(arg == "-co") {
 				irradUTCOffset = atof(argv[++i]);
+			} else if(arg == "-ci") {
+				persistIndex = true;
+			} else if(arg == "-cb") {
+				bandDef = argv[++i];
+			} else if(arg == "-cbd") {
+				bandDefDelim = argv[++i];
+			} else if(arg == "-cs") {
+				irradScale = atof(argv[++i]);
+			} else if(arg == "-cf") {
+				irradShift = atof(argv[++i]);
+			} else if(arg == "-ct") {
+				irradThreshold = atof(argv[++i]);
+			} else if(arg == "-cds") {
+				irradDelim = argv[++i];
+			} else if(arg == "-cfr") {
+				irradFirstRow = atoi(argv[++i]);
+			} else if(arg == "-cfc") {
+				irradFirstCol = atoi(argv[++i]);
+			} else if(arg == "-cdc") {
+				irradDateCol = atoi(argv[++i]);
+			} else if(arg == "-ctc") {
+				irradTimeCol = atoi(argv[++i]);
 			}
 		}
 
@@ -335,7 +413,18 @@ int main(int argc, char** argv) {
 		bool running = true;
 		Reflectance refl;
 		DummyListener listener;
-		refl.run(listener, imuGps, imuUTCOffset, rawRad, frameIdx, irradConv, irradUTCOffset, reflOut, running);
+		if(bandDef.empty()) {
+			refl.run(listener, imuGps, imuUTCOffset, rawRad, frameIdx, irradConv, irradUTCOffset, reflOut, running, imuCache, persistIndex);
+		} else {
+			// Convolve the raw irradiance straight into memory and hand it to the reflectance stage.
+			FlameReader fr(irradUTCOffset * 3600000);
+			Convolve conv;
+			DummyConvolveListener convListener;
+			conv.run(convListener, bandDef, bandDefDelim, irradConv, irradDelim,
+					irradFirstRow, irradFirstCol, irradDateCol, irradTimeCol,
+					irradScale, irradThreshold, irradShift, fr, running);
+			refl.run(listener, imuGps, imuUTCOffset, rawRad, frameIdx, fr, reflOut, running, imuCache);
+		}
 
 	}
 
@@ -18,6 +18,7 @@
 #include <gdal_priv.h>
 
 #include "writer.hpp"
+#include "reader.hpp"
 
 #include "util.hpp"
 #include "stats.hpp"
@@ -252,3 +253,41 @@ bool CSVWriter::writeStats(const std::string& /*filename*/, const std::vector<st
 
 CSVWriter::~CSVWriter() {
 }
+
+SpectralLogWriter::SpectralLogWriter(const std::string& filename, const std::vector<double>& wavelengths, const std::string& unit) :
+	m_bands(wavelengths.size()),
+	m_records(0) {
+
+	using namespace hlrg::reader;
+
+	m_output.open(filename, std::ios::out|std::ios::binary|std::ios::trunc);
+	if(!m_output)
+		throw std::runtime_error("Failed to open spectral log " + filename);
+
+	slog::Header hdr;
+	std::memset(&hdr, 0, sizeof(hdr));
+	std::memcpy(hdr.magic, slog::MAGIC, sizeof(hdr.magic));
+	hdr.version = slog::VERSION;
+	hdr.bands = (uint32_t) m_bands;
+	hdr.records = 0;
+	std::strncpy(hdr.units, unit.c_str(), sizeof(hdr.units) - 1);
+	m_output.write((const char*) &hdr, sizeof(hdr));
+	m_output.write((const char*) wavelengths.data(), m_bands * sizeof(double));
+	m_buf.resize(m_bands);
+}
+
+void SpectralLogWriter::write(long dateTime, long utcTime, const std::vector<double>& values) {
+	if(values.size() != m_bands)
+		throw std::runtime_error("Record has the wrong number of bands.");
+	int64_t t[2] = {dateTime, utcTime};
+	std::copy(values.begin(), values.end(), m_buf.begin());
+	m_output.write((const char*) t, sizeof(t));
+	m_output.write((const char*) m_buf.data(), m_bands * sizeof(float));
+	++m_records;
+}
+
+SpectralLogWriter::~SpectralLogWriter() {
+	m_output.seekp(offsetof(hlrg::reader::slog::Header, records));
+	m_output.write((const char*) &m_records, sizeof(m_records));
+	m_output.close();
+}